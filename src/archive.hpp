@@ -0,0 +1,677 @@
+/*
+Copyright 2023 larkwiot
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+		http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include <algorithm>
+#include <charconv>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <zlib.h>
+
+#include "candidates.hpp"
+#include "file_reader.hpp"
+#include "log.hpp"
+#include "test.hpp"
+#include "util.hpp"
+
+#pragma once
+
+// separates an archive's path from the path of a file inside it, as in bundle.zip!/books/book.epub
+static constexpr std::string_view archive_separator = "!/";
+
+enum class ArchiveFormat {
+	zip,
+	tar,
+};
+
+struct ArchiveMember {
+	std::string name;
+	// zip: where the member's local header starts, tar: where its data starts
+	std::uint64_t offset{};
+	std::uint64_t compressed_size{};
+	std::uint64_t size{};
+	// zip compression method, 0 stored and 8 deflate, always 0 for tar
+	std::uint16_t method{};
+};
+
+std::optional<ArchiveFormat> archive_format(const std::string& filepath) {
+	const auto extension = lowercase(get_file_extension(filepath));
+	if (extension == "zip") {
+		return ArchiveFormat::zip;
+	}
+	if (extension == "tar") {
+		return ArchiveFormat::tar;
+	}
+	return std::nullopt;
+}
+
+bool is_archive_member_path(std::string_view filepath) {
+	return filepath.find(archive_separator) != std::string_view::npos;
+}
+
+std::optional<std::string> pread_exact(int fd, std::uint64_t offset, std::size_t length) {
+	std::string bytes(length, '\0');
+	std::size_t done = 0;
+	while (done < length) {
+		const auto got = pread(fd, bytes.data() + done, length - done, static_cast<off_t>(offset + done));
+		if (got < 0 && errno == EINTR) {
+			continue;
+		}
+		if (got <= 0) {
+			return std::nullopt;
+		}
+		done += static_cast<std::size_t>(got);
+	}
+	return bytes;
+}
+
+// Reads exactly length bytes at offset of a file or a buffer, nothing if there are not that many. Lets the archive
+// readers below work on files on disk as well as on members already read into memory.
+using ReadAt = std::function<std::optional<std::string>(std::uint64_t offset, std::size_t length)>;
+
+ReadAt read_at_fd(int fd) {
+	return [fd](std::uint64_t offset, std::size_t length) {
+		return pread_exact(fd, offset, length);
+	};
+}
+
+ReadAt read_at_buffer(std::string_view bytes) {
+	return [bytes](std::uint64_t offset, std::size_t length) -> std::optional<std::string> {
+		if (offset > bytes.size() || length > bytes.size() - offset) {
+			return std::nullopt;
+		}
+		return std::string{bytes.substr(static_cast<std::size_t>(offset), length)};
+	};
+}
+
+template <typename T>
+T little_endian(std::string_view bytes, std::size_t offset) {
+	T value = 0;
+	for (std::size_t i = 0; i < sizeof(T); i++) {
+		const auto byte = static_cast<T>(static_cast<unsigned char>(bytes[offset + i]));
+		value = static_cast<T>(value | static_cast<T>(byte << (8 * i)));
+	}
+	return value;
+}
+
+// Lists a zip's files from its central directory, including zip64 archives. Nothing if it is not a readable zip.
+std::optional<std::vector<ArchiveMember>> list_zip_members(const ReadAt& read_at, std::uint64_t file_size) {
+	static constexpr std::size_t end_record_size = 22;
+	static constexpr std::size_t max_comment = 0xffff;
+	static constexpr std::uint32_t saturated = 0xffffffff;
+
+	if (file_size < end_record_size) {
+		return std::nullopt;
+	}
+
+	const auto tail_length =
+		static_cast<std::size_t>(std::min<std::uint64_t>(file_size, end_record_size + max_comment));
+	const auto tail_offset = file_size - tail_length;
+	const auto tail = read_at(tail_offset, tail_length);
+	if (!tail) {
+		return std::nullopt;
+	}
+
+	const auto end_position = tail->rfind("PK\x05\x06");
+	if (end_position == std::string::npos || end_position + end_record_size > tail->size()) {
+		return std::nullopt;
+	}
+	const std::string_view end_record = std::string_view{tail.value()}.substr(end_position);
+
+	std::uint64_t entries = little_endian<std::uint16_t>(end_record, 10);
+	std::uint64_t directory_size = little_endian<std::uint32_t>(end_record, 12);
+	std::uint64_t directory_offset = little_endian<std::uint32_t>(end_record, 16);
+
+	// zip64 keeps the real values in another record, found through a locator just before the end record
+	if (entries == 0xffff || directory_size == saturated || directory_offset == saturated) {
+		static constexpr std::size_t locator_size = 20;
+		static constexpr std::size_t zip64_end_size = 56;
+		const auto locator_offset = tail_offset + end_position;
+		if (locator_offset < locator_size) {
+			return std::nullopt;
+		}
+		const auto locator = read_at(locator_offset - locator_size, locator_size);
+		if (!locator || !locator->starts_with("PK\x06\x07")) {
+			return std::nullopt;
+		}
+		const auto zip64_end = read_at(little_endian<std::uint64_t>(locator.value(), 8), zip64_end_size);
+		if (!zip64_end || !zip64_end->starts_with("PK\x06\x06")) {
+			return std::nullopt;
+		}
+		entries = little_endian<std::uint64_t>(zip64_end.value(), 32);
+		directory_size = little_endian<std::uint64_t>(zip64_end.value(), 40);
+		directory_offset = little_endian<std::uint64_t>(zip64_end.value(), 48);
+	}
+
+	if (directory_offset + directory_size > file_size) {
+		return std::nullopt;
+	}
+	const auto directory = read_at(directory_offset, static_cast<std::size_t>(directory_size));
+	if (!directory) {
+		return std::nullopt;
+	}
+
+	static constexpr std::size_t header_size = 46;
+	std::vector<ArchiveMember> members{};
+	std::size_t position = 0;
+	for (std::uint64_t entry = 0; entry < entries; entry++) {
+		const std::string_view header = std::string_view{directory.value()}.substr(position);
+		if (header.size() < header_size || !header.starts_with("PK\x01\x02")) {
+			return std::nullopt;
+		}
+
+		const auto flags = little_endian<std::uint16_t>(header, 8);
+		const auto name_length = little_endian<std::uint16_t>(header, 28);
+		const auto extra_length = little_endian<std::uint16_t>(header, 30);
+		const auto comment_length = little_endian<std::uint16_t>(header, 32);
+		if (header.size() < header_size + name_length + extra_length + comment_length) {
+			return std::nullopt;
+		}
+
+		ArchiveMember member{};
+		member.name = std::string{header.substr(header_size, name_length)};
+		member.method = little_endian<std::uint16_t>(header, 10);
+		member.compressed_size = little_endian<std::uint32_t>(header, 20);
+		member.size = little_endian<std::uint32_t>(header, 24);
+		member.offset = little_endian<std::uint32_t>(header, 42);
+
+		// the zip64 extra field holds, in order, whichever of these were too big for their usual place
+		auto extra = header.substr(header_size + name_length, extra_length);
+		while (extra.size() >= 4) {
+			const auto id = little_endian<std::uint16_t>(extra, 0);
+			const auto length = little_endian<std::uint16_t>(extra, 2);
+			auto field = extra.substr(4, length);
+			if (id == 0x0001) {
+				for (auto* value : {&member.size, &member.compressed_size, &member.offset}) {
+					if (*value == saturated && field.size() >= 8) {
+						*value = little_endian<std::uint64_t>(field, 0);
+						field.remove_prefix(8);
+					}
+				}
+			}
+			extra.remove_prefix(std::min<std::size_t>(extra.size(), 4 + length));
+		}
+
+		position += header_size + name_length + extra_length + comment_length;
+
+		// the sizes are only trusted as far as the archive can hold them, a stored member is as big as its data
+		const bool encrypted = (flags & 0x1) != 0;
+		const bool truncated = member.offset > file_size || member.compressed_size > file_size - member.offset ||
+							   (member.method == 0 && member.size != member.compressed_size);
+		if (member.name.ends_with('/') || encrypted || truncated) {
+			continue;
+		}
+		members.push_back(std::move(member));
+	}
+
+	return members;
+}
+
+std::uint64_t parse_tar_number(std::string_view field) {
+	// GNU base-256 for values that do not fit in octal
+	if (!field.empty() && (static_cast<unsigned char>(field[0]) & 0x80) != 0) {
+		std::uint64_t value = static_cast<unsigned char>(field[0]) & 0x7f;
+		for (auto c : field.substr(1)) {
+			value = (value << 8) | static_cast<unsigned char>(c);
+		}
+		return value;
+	}
+
+	std::uint64_t value = 0;
+	for (auto c : field) {
+		if (c >= '0' && c <= '7') {
+			value = value * 8 + static_cast<std::uint64_t>(c - '0');
+		} else if (c != ' ' || value != 0) {
+			break;
+		}
+	}
+	return value;
+}
+
+std::string_view tar_string(std::string_view field) {
+	return field.substr(0, std::min(field.size(), field.find('\0')));
+}
+
+// Lists the regular files in an uncompressed tar (ustar, GNU long names and pax paths). Nothing if it is not a tar.
+std::optional<std::vector<ArchiveMember>> list_tar_members(const ReadAt& read_at, std::uint64_t file_size) {
+	static constexpr std::size_t block = 512;
+	// long names and pax headers are read whole, anything bigger than this is a corrupt size field
+	static constexpr std::uint64_t max_metadata_size = 1 << 20;
+
+	std::vector<ArchiveMember> members{};
+	std::optional<std::string> next_name{};
+
+	for (std::uint64_t offset = 0; offset + block <= file_size;) {
+		const auto header = read_at(offset, block);
+		if (!header) {
+			return std::nullopt;
+		}
+		if (std::all_of(header->begin(), header->end(), [](char c) {
+				return c == '\0';
+			})) {
+			break;
+		}
+
+		// the checksum is the header's byte sum with the checksum field itself counted as spaces
+		std::uint64_t sum = 0;
+		for (std::size_t i = 0; i < block; i++) {
+			sum += (i >= 148 && i < 156) ? ' ' : static_cast<unsigned char>((*header)[i]);
+		}
+		if (sum != parse_tar_number(std::string_view{header.value()}.substr(148, 8))) {
+			return std::nullopt;
+		}
+
+		const std::string_view view{header.value()};
+		const auto size = parse_tar_number(view.substr(124, 12));
+		const auto type = view[156];
+		const auto data_offset = offset + block;
+		offset = data_offset + (size + block - 1) / block * block;
+
+		if (type == 'L' || type == 'x') {
+			if (size > max_metadata_size || data_offset + size > file_size) {
+				return std::nullopt;
+			}
+			const auto data = read_at(data_offset, static_cast<std::size_t>(size));
+			if (!data) {
+				return std::nullopt;
+			}
+			if (type == 'L') {
+				next_name = std::string{tar_string(data.value())};
+				continue;
+			}
+
+			// pax records are "<length> <key>=<value>\n", the length in decimal and counting the whole record
+			std::string_view records{data.value()};
+			while (!records.empty()) {
+				const auto space = records.find(' ');
+				std::size_t length = 0;
+				std::from_chars(records.data(), records.data() + std::min(space, records.size()), length);
+				if (space == std::string_view::npos || length < space + 2 || length > records.size()) {
+					break;
+				}
+				const auto record = records.substr(space + 1, length - space - 2);
+				if (record.starts_with("path=")) {
+					next_name = std::string{record.substr(5)};
+				}
+				records.remove_prefix(length);
+			}
+			continue;
+		}
+
+		std::string name{tar_string(view.substr(0, 100))};
+		if (view.substr(257, 5) == "ustar" && !tar_string(view.substr(345, 155)).empty()) {
+			name = std::string{tar_string(view.substr(345, 155))} + "/" + name;
+		}
+		if (next_name.has_value()) {
+			name = std::move(next_name.value());
+			next_name.reset();
+		}
+
+		if ((type == '0' || type == '\0') && !name.ends_with('/') && size <= file_size - data_offset) {
+			members.push_back(ArchiveMember{std::move(name), data_offset, size, size, 0});
+		}
+	}
+
+	return members;
+}
+
+// Reads up to max_length bytes of a member's contents, inflating them as it goes so a short read only inflates
+// as much as it returns
+FileRead read_zip_member(const ReadAt& read_at, const ArchiveMember& member, std::size_t max_length) {
+	static constexpr std::size_t local_header_size = 30;
+	static constexpr std::size_t chunk = 1 << 16;
+	// the most deflate can shrink anything by, a member claiming to inflate to more than this is lying about its size
+	static constexpr std::uint64_t max_deflate_ratio = 1032;
+
+	const auto local_header = read_at(member.offset, local_header_size);
+	if (!local_header || !local_header->starts_with("PK\x03\x04")) {
+		return FileRead::failed(ReadError::read_failed, EINVAL);
+	}
+	const auto data_offset = member.offset + local_header_size +
+							 little_endian<std::uint16_t>(local_header.value(), 26) +
+							 little_endian<std::uint16_t>(local_header.value(), 28);
+
+	auto length = std::min<std::uint64_t>(member.size, max_length);
+	if (member.method == 8) {
+		length = std::min(length, member.compressed_size * max_deflate_ratio);
+	}
+
+	FileRead read{};
+	read.bytes.resize(static_cast<std::size_t>(length));
+
+	if (member.method == 0) {
+		auto bytes = read_at(data_offset, read.bytes.size());
+		if (!bytes) {
+			return FileRead::failed(ReadError::read_failed, EIO);
+		}
+		read.bytes = std::move(bytes.value());
+		return read;
+	}
+
+	if (member.method != 8) {
+		return FileRead::failed(ReadError::read_failed, ENOTSUP);
+	}
+
+	z_stream stream{};
+	if (inflateInit2(&stream, -MAX_WBITS) != Z_OK) {
+		return FileRead::failed(ReadError::read_failed, ENOMEM);
+	}
+
+	std::string input{};
+	std::uint64_t consumed = 0;
+	std::size_t produced = 0;
+	int status = Z_OK;
+	while (produced < read.bytes.size() && status != Z_STREAM_END) {
+		if (stream.avail_in == 0) {
+			const auto length =
+				static_cast<std::size_t>(std::min<std::uint64_t>(chunk, member.compressed_size - consumed));
+			if (length == 0) {
+				break;
+			}
+			auto bytes = read_at(data_offset + consumed, length);
+			if (!bytes) {
+				inflateEnd(&stream);
+				return FileRead::failed(ReadError::read_failed, EIO);
+			}
+			input = std::move(bytes.value());
+			consumed += length;
+			stream.next_in = reinterpret_cast<Bytef*>(input.data());
+			stream.avail_in = static_cast<uInt>(input.size());
+		}
+
+		const auto room = std::min<std::size_t>(read.bytes.size() - produced, std::numeric_limits<uInt>::max());
+		stream.next_out = reinterpret_cast<Bytef*>(read.bytes.data() + produced);
+		stream.avail_out = static_cast<uInt>(room);
+		status = inflate(&stream, Z_NO_FLUSH);
+		produced += room - stream.avail_out;
+
+		if (status != Z_OK && status != Z_STREAM_END && status != Z_BUF_ERROR) {
+			inflateEnd(&stream);
+			return FileRead::failed(ReadError::read_failed, EILSEQ);
+		}
+	}
+	inflateEnd(&stream);
+
+	read.bytes.resize(produced);
+	return read;
+}
+
+// The members of the archives found while walking the input, so that the files inside them can be scheduled and read
+// like any other file (by their archive path, archive_separator and member name) without extracting them to disk.
+class Archives {
+	struct Listing {
+		ArchiveFormat format;
+		std::unordered_map<std::string, ArchiveMember> members;
+	};
+
+	std::mutex _mutex{};
+	std::map<std::string, Listing, std::less<>> _archives{};
+
+   public:
+	// (Re-)reads an archive's listing and returns the paths of its members
+	std::optional<std::vector<std::pair<std::string, std::uint64_t>>> list(const std::string& archive_path) {
+		const auto format = archive_format(archive_path);
+		if (!format.has_value()) {
+			return std::nullopt;
+		}
+
+		int fd = -1;
+		const auto opened = open_for_read(archive_path, fd, 0);
+		if (!opened) {
+			error_log()->error("Archives: could not open {}: {}", archive_path, opened.describe());
+			return std::nullopt;
+		}
+
+		std::error_code error{};
+		const auto size = std::filesystem::file_size(archive_path, error);
+		const auto read_at = read_at_fd(fd);
+		auto members = format.value() == ArchiveFormat::zip ? list_zip_members(read_at, size)
+															: list_tar_members(read_at, size);
+		close(fd);
+
+		if (!members.has_value()) {
+			console_log()->warn("Archives: {} is not a readable {} archive", archive_path,
+								magic_enum::enum_name(format.value()));
+			return std::nullopt;
+		}
+
+		std::vector<std::pair<std::string, std::uint64_t>> paths{};
+		Listing listing{format.value(), {}};
+		for (auto& member : members.value()) {
+			paths.emplace_back(fmt::format("{}{}{}", archive_path, archive_separator, member.name), member.size);
+			listing.members.emplace(member.name, std::move(member));
+		}
+
+		std::lock_guard lock{_mutex};
+		_archives.insert_or_assign(archive_path, std::move(listing));
+		return paths;
+	}
+
+	// Reads up to max_length bytes of the member a path like bundle.zip!/book.epub refers to
+	FileRead read(const std::string& member_path, std::size_t max_length = std::numeric_limits<std::size_t>::max()) {
+		const auto separator = member_path.find(archive_separator);
+		if (separator == std::string::npos) {
+			return FileRead::failed(ReadError::not_a_file, EINVAL);
+		}
+		const auto archive_path = member_path.substr(0, separator);
+		const auto name = member_path.substr(separator + archive_separator.size());
+
+		std::optional<ArchiveFormat> format{};
+		ArchiveMember member{};
+		{
+			std::lock_guard lock{_mutex};
+			const auto archive = _archives.find(archive_path);
+			if (archive != _archives.end() && archive->second.members.contains(name)) {
+				format = archive->second.format;
+				member = archive->second.members.at(name);
+			}
+		}
+		if (!format.has_value()) {
+			return FileRead::failed(ReadError::open_failed, ENOENT);
+		}
+
+		int fd = -1;
+		auto opened = open_for_read(archive_path, fd, 0);
+		if (!opened) {
+			return opened;
+		}
+
+		FileRead read{};
+		if (format.value() == ArchiveFormat::zip) {
+			read = read_zip_member(read_at_fd(fd), member, max_length);
+		} else {
+			const auto length = static_cast<std::size_t>(std::min<std::uint64_t>(member.size, max_length));
+			auto bytes = pread_exact(fd, member.offset, length);
+			read = bytes ? FileRead{std::move(bytes.value())} : FileRead::failed(ReadError::read_failed, EIO);
+		}
+		close(fd);
+		return read;
+	}
+};
+
+TEST_CASE("Archives") {
+	using namespace std::string_literals;
+
+	const auto root = std::filesystem::temp_directory_path() / fmt::format("isbn_scanner_archive_{}", getpid());
+	std::filesystem::create_directories(root);
+
+	auto u16 = [](std::uint16_t value) {
+		return std::string{static_cast<char>(value & 0xff), static_cast<char>(value >> 8)};
+	};
+	auto u32 = [&u16](std::uint32_t value) {
+		return u16(static_cast<std::uint16_t>(value & 0xffff)) + u16(static_cast<std::uint16_t>(value >> 16));
+	};
+
+	const std::string stored = "stored member contents";
+	const std::string text = "ISBN 978-0-7356-8293-1 " + std::string(200000, 'z');
+
+	std::string deflated(compressBound(static_cast<uLong>(text.size())), '\0');
+	{
+		z_stream stream{};
+		REQUIRE(deflateInit2(&stream, 6, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) == Z_OK);
+		stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(text.data()));
+		stream.avail_in = static_cast<uInt>(text.size());
+		stream.next_out = reinterpret_cast<Bytef*>(deflated.data());
+		stream.avail_out = static_cast<uInt>(deflated.size());
+		REQUIRE(deflate(&stream, Z_FINISH) == Z_STREAM_END);
+		deflated.resize(stream.total_out);
+		deflateEnd(&stream);
+	}
+
+	{
+		struct Entry {
+			std::string name;
+			std::uint16_t method;
+			std::string data;
+			std::size_t size;
+			std::size_t compressed_size;
+		};
+		// the last two claim more than the archive holds, either data past its end or far too much once inflated
+		const std::vector<Entry> entries{{"books/", 0, "", 0, 0},
+										 {"books/a.epub", 0, stored, stored.size(), stored.size()},
+										 {"books/b.pdf", 8, deflated, text.size(), deflated.size()},
+										 {"books/cut.epub", 0, stored, 1 << 20, 1 << 20},
+										 {"books/bomb.pdf", 8, deflated, 0xfffffffe, deflated.size()}};
+
+		std::string zip{};
+		std::string directory{};
+		for (const auto& entry : entries) {
+			const auto offset = static_cast<std::uint32_t>(zip.size());
+			const auto sizes = u32(0) + u32(static_cast<std::uint32_t>(entry.compressed_size)) +
+							   u32(static_cast<std::uint32_t>(entry.size)) +
+							   u16(static_cast<std::uint16_t>(entry.name.size())) + u16(0);
+			zip += "PK\x03\x04"s + u16(20) + u16(0) + u16(entry.method) + u32(0) + sizes + entry.name + entry.data;
+			directory += "PK\x01\x02"s + u16(20) + u16(20) + u16(0) + u16(entry.method) + u32(0) + sizes + u16(0) +
+						 u16(0) + u16(0) + u32(0) + u32(offset) + entry.name;
+		}
+		const auto directory_offset = static_cast<std::uint32_t>(zip.size());
+		zip += directory;
+		zip += "PK\x05\x06"s + u16(0) + u16(0) + u16(static_cast<std::uint16_t>(entries.size())) +
+			   u16(static_cast<std::uint16_t>(entries.size())) + u32(static_cast<std::uint32_t>(directory.size())) +
+			   u32(directory_offset) + u16(0);
+
+		std::ofstream fh(root / "bundle.zip", std::ios::binary);
+		fh << zip;
+	}
+
+	{
+		auto tar_header = [](const std::string& name, std::size_t size, char type) {
+			std::string header(512, '\0');
+			header.replace(0, name.size(), name);
+			header.replace(100, 7, "0000644");
+			const auto octal_size = fmt::format("{:011o}", size);
+			header.replace(124, octal_size.size(), octal_size);
+			header[156] = type;
+			header.replace(257, 6, "ustar"s + '\0');
+			header.replace(148, 8, "        ");
+			unsigned sum = 0;
+			for (auto c : header) {
+				sum += static_cast<unsigned char>(c);
+			}
+			const auto checksum = fmt::format("{:06o}", sum);
+			header.replace(148, 7, checksum + '\0');
+			return header;
+		};
+		auto padded = [](std::string data) {
+			data.resize((data.size() + 511) / 512 * 512, '\0');
+			return data;
+		};
+
+		const std::string long_name = std::string(120, 'n') + ".mobi";
+		std::string tar = tar_header("dir/", 0, '5') + tar_header("dir/c.epub", stored.size(), '0') + padded(stored) +
+						  tar_header("././@LongLink", long_name.size() + 1, 'L') + padded(long_name + '\0') +
+						  tar_header(long_name.substr(0, 99), 3, '0') + padded("abc") + std::string(1024, '\0');
+
+		std::ofstream fh(root / "bundle.tar", std::ios::binary);
+		fh << tar;
+		fh.close();
+
+		// 27 bytes, which a pax reader taking the length for octal would cut short
+		const std::string pax = "27 path=dir/pax-named.epub\n";
+		fh.open(root / "pax.tar", std::ios::binary | std::ios::trunc);
+		fh << tar_header("PaxHeader", pax.size(), 'x') + padded(pax) + tar_header("short", 3, '0') + padded("abc") +
+				  std::string(1024, '\0');
+		fh.close();
+
+		// a long name header claiming more data than there is, or a gigabyte of it
+		fh.open(root / "truncated.tar", std::ios::binary | std::ios::trunc);
+		fh << tar_header("././@LongLink", 4096, 'L') + padded("name") + std::string(1024, '\0');
+		fh.close();
+		fh.open(root / "huge.tar", std::ios::binary | std::ios::trunc);
+		fh << tar_header("././@LongLink", 1 << 30, 'L') + std::string(1024, '\0');
+		fh.close();
+		fh.open(root / "cut.tar", std::ios::binary | std::ios::trunc);
+		fh << tar_header("cut.epub", 1 << 20, '0') + padded("abc") + std::string(1024, '\0');
+	}
+
+	Archives archives{};
+
+	const auto zip_path = (root / "bundle.zip").string();
+	const auto zip_members = archives.list(zip_path);
+	REQUIRE(zip_members.has_value());
+	REQUIRE(zip_members->size() == 3);
+	CHECK(zip_members->at(0).first == zip_path + "!/books/a.epub");
+	CHECK(zip_members->at(1).second == text.size());
+	CHECK(zip_members->at(2).first == zip_path + "!/books/bomb.pdf");
+
+	CHECK(is_archive_member_path(zip_members->at(0).first));
+	CHECK(archives.read(zip_path + "!/books/a.epub").bytes == stored);
+	CHECK(archives.read(zip_path + "!/books/b.pdf").bytes == text);
+	CHECK(archives.read(zip_path + "!/books/b.pdf", 100).bytes == text.substr(0, 100));
+	CHECK(archives.read(zip_path + "!/books/missing.pdf").error == ReadError::open_failed);
+	CHECK(archives.read(zip_path + "!/books/bomb.pdf").bytes == text);
+
+	const auto tar_path = (root / "bundle.tar").string();
+	const auto tar_members = archives.list(tar_path);
+	REQUIRE(tar_members.has_value());
+	REQUIRE(tar_members->size() == 2);
+	CHECK(tar_members->at(1).first == tar_path + "!/" + std::string(120, 'n') + ".mobi");
+	CHECK(archives.read(tar_path + "!/dir/c.epub").bytes == stored);
+	CHECK(archives.read(tar_members->at(1).first).bytes == "abc");
+
+	const auto pax_members = archives.list((root / "pax.tar").string());
+	REQUIRE(pax_members.has_value());
+	REQUIRE(pax_members->size() == 1);
+	CHECK(pax_members->at(0).first == (root / "pax.tar").string() + "!/dir/pax-named.epub");
+
+	CHECK(!archives.list((root / "truncated.tar").string()).has_value());
+	CHECK(!archives.list((root / "huge.tar").string()).has_value());
+	const auto cut_members = archives.list((root / "cut.tar").string());
+	REQUIRE(cut_members.has_value());
+	CHECK(cut_members->empty());
+
+	{
+		std::ofstream fh(root / "broken.zip", std::ios::binary);
+		fh << "not a zip at all";
+	}
+	CHECK(!archives.list((root / "broken.zip").string()).has_value());
+	CHECK(!archives.list((root / "book.epub").string()).has_value());
+
+	std::filesystem::remove_all(root);
+}
@@ -0,0 +1,347 @@
+/*
+Copyright 2023 larkwiot
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+		http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstdlib>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <utility>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <spdlog/spdlog.h>
+
+#include "log.hpp"
+#include "test.hpp"
+
+#pragma once
+
+// Shared by everything one run does. Once cancelled, loops stop taking new work, sleeps wake up early and registered
+// callbacks abort whatever is blocking (e.g. stopping an HTTP client mid-request).
+class CancellationToken {
+	std::atomic<bool> _cancelled{false};
+	mutable std::mutex _mutex{};
+	mutable std::condition_variable _wake{};
+	std::map<std::size_t, std::function<void()>> _callbacks{};
+	std::size_t _next_id{};
+
+   public:
+	// Keeps a callback registered for as long as it lives. Callbacks run under the token's lock, so once this is
+	// destroyed its callback is guaranteed not to be running and whatever it refers to can go away.
+	class Registration {
+		CancellationToken* _token{};
+		std::size_t _id{};
+
+	   public:
+		Registration() = default;
+		Registration(CancellationToken* token, std::size_t id) : _token(token), _id(id){};
+		Registration(const Registration&) = delete;
+		Registration& operator=(const Registration&) = delete;
+		Registration(Registration&& other) noexcept : _token(std::exchange(other._token, nullptr)), _id(other._id){};
+		~Registration() {
+			if (_token != nullptr) {
+				std::lock_guard lock{_token->_mutex};
+				_token->_callbacks.erase(_id);
+			}
+		}
+	};
+
+	bool cancelled() const {
+		return _cancelled.load(std::memory_order_acquire);
+	}
+
+	void cancel() {
+		std::lock_guard lock{_mutex};
+		if (_cancelled.exchange(true, std::memory_order_acq_rel)) {
+			return;
+		}
+
+		_wake.notify_all();
+		for (auto& [id, callback] : _callbacks) {
+			callback();
+		}
+		_callbacks.clear();
+	}
+
+	// runs right away if already cancelled, callbacks must not use the token themselves
+	[[nodiscard]] Registration on_cancel(std::function<void()> callback) {
+		std::lock_guard lock{_mutex};
+		if (cancelled()) {
+			callback();
+			return Registration{};
+		}
+
+		const auto id = _next_id++;
+		_callbacks.emplace(id, std::move(callback));
+		return Registration{this, id};
+	}
+
+	// false if cancelled before the time was up
+	template <typename Rep, typename Period>
+	bool sleep_for(std::chrono::duration<Rep, Period> duration) const {
+		std::unique_lock lock{_mutex};
+		return !_wake.wait_for(lock, duration, [this]() {
+			return cancelled();
+		});
+	}
+};
+
+TEST_CASE("CancellationToken") {
+	CancellationToken token{};
+	int stopped = 0;
+
+	{
+		auto registration = token.on_cancel([&stopped]() {
+			stopped += 10;
+		});
+	}
+	auto registration = token.on_cancel([&stopped]() {
+		stopped++;
+	});
+	CHECK(token.sleep_for(std::chrono::milliseconds(1)));
+
+	std::thread canceller{[&token]() {
+		std::this_thread::sleep_for(std::chrono::milliseconds(20));
+		token.cancel();
+	}};
+	const auto start = std::chrono::steady_clock::now();
+	CHECK(!token.sleep_for(std::chrono::seconds(10)));
+	CHECK(std::chrono::steady_clock::now() - start < std::chrono::seconds(5));
+	canceller.join();
+
+	token.cancel();
+	CHECK(token.cancelled());
+	// the first registration was dropped before cancelling, the second ran exactly once
+	CHECK(stopped == 1);
+
+	auto late = token.on_cancel([&stopped]() {
+		stopped++;
+	});
+	CHECK(stopped == 2);
+}
+
+// Cancels tokens once their time is up, from a single thread however many are being timed
+class Deadlines {
+	using Key = std::pair<std::chrono::steady_clock::time_point, std::size_t>;
+
+	std::mutex _mutex{};
+	std::condition_variable _changed{};
+	std::map<Key, CancellationToken*> _pending{};
+	std::size_t _next_id{};
+	bool _stop = false;
+	std::thread _thread{};
+
+	void run() {
+		std::unique_lock lock{_mutex};
+		while (!_stop) {
+			if (_pending.empty()) {
+				_changed.wait(lock);
+				continue;
+			}
+
+			const auto next = _pending.begin();
+			if (std::chrono::steady_clock::now() < next->first.first) {
+				_changed.wait_until(lock, next->first.first);
+				continue;
+			}
+
+			next->second->cancel();
+			_pending.erase(next);
+		}
+	}
+
+   public:
+	// Times its token for as long as it lives. Tokens are cancelled under the lock, so once this is destroyed the token
+	// is guaranteed not to be touched again.
+	class Timer {
+		Deadlines* _deadlines{};
+		Key _key{};
+
+	   public:
+		Timer(Deadlines* deadlines, Key key) : _deadlines(deadlines), _key(key){};
+		Timer(const Timer&) = delete;
+		Timer& operator=(const Timer&) = delete;
+		Timer(Timer&& other) noexcept : _deadlines(std::exchange(other._deadlines, nullptr)), _key(other._key){};
+		~Timer() {
+			if (_deadlines != nullptr) {
+				std::lock_guard lock{_deadlines->_mutex};
+				_deadlines->_pending.erase(_key);
+			}
+		}
+	};
+
+	Deadlines() {
+		_thread = std::thread{[this]() {
+			run();
+		}};
+	}
+
+	Deadlines(const Deadlines&) = delete;
+	Deadlines& operator=(const Deadlines&) = delete;
+
+	~Deadlines() {
+		{
+			std::lock_guard lock{_mutex};
+			_stop = true;
+		}
+		_changed.notify_all();
+		_thread.join();
+	}
+
+	[[nodiscard]] Timer start(CancellationToken& token, std::chrono::milliseconds budget) {
+		std::lock_guard lock{_mutex};
+		const Key key{std::chrono::steady_clock::now() + budget, _next_id++};
+		_pending.emplace(key, &token);
+		_changed.notify_all();
+		return Timer{this, key};
+	}
+};
+
+TEST_CASE("Deadlines") {
+	Deadlines deadlines{};
+	CancellationToken slow{};
+	CancellationToken fast{};
+
+	{
+		auto stopped = deadlines.start(fast, std::chrono::milliseconds(10));
+	}
+	auto timer = deadlines.start(slow, std::chrono::milliseconds(20));
+	auto later = deadlines.start(fast, std::chrono::hours(1));
+
+	CHECK(!slow.sleep_for(std::chrono::seconds(5)));
+	// the first timer was dropped before its time was up, the other one has plenty left
+	CHECK(!fast.cancelled());
+}
+
+// Turns SIGINT and SIGTERM into cancelling token. If the run has not wound down grace after the first signal, or a
+// second one arrives, force() runs (e.g. to save what is done so far) and the process exits. A third signal exits
+// immediately. Only one may exist at a time.
+class ShutdownSignals {
+	static inline std::atomic<int> _received{0};
+	static inline int _pipe[2]{-1, -1};
+
+	CancellationToken& _token;
+	std::chrono::milliseconds _grace;
+	std::atomic<bool> _stop{false};
+	std::mutex _mutex{};
+	std::function<void()> _force{};
+	std::thread _thread{};
+
+	// only async-signal-safe calls in here, everything else happens on _thread
+	static void handle(int) {
+		if (_received.fetch_add(1) >= 2) {
+			std::_Exit(130);
+		}
+		const char byte = 1;
+		[[maybe_unused]] auto written = write(_pipe[1], &byte, 1);
+	}
+
+	void force_exit() {
+		error_log()->error("ShutdownSignals: exiting without waiting for work in progress");
+		{
+			std::lock_guard lock{_mutex};
+			if (_force) {
+				_force();
+			}
+		}
+		spdlog::shutdown();
+		std::_Exit(130);
+	}
+
+	void run() {
+		int seen = 0;
+		std::optional<std::chrono::steady_clock::time_point> deadline{};
+
+		while (!_stop.load()) {
+			pollfd pending{_pipe[0], POLLIN, 0};
+			poll(&pending, 1, 100);
+
+			char bytes[8];
+			while (read(_pipe[0], bytes, sizeof(bytes)) > 0) {
+			}
+
+			const int received = _received.load();
+			if (received > seen && seen == 0) {
+				console_log()->warn("ShutdownSignals: stopping, finishing up within {}s (signal again to exit now)",
+									std::chrono::duration<double>(_grace).count());
+				deadline = std::chrono::steady_clock::now() + _grace;
+				_token.cancel();
+			}
+			seen = received;
+
+			if (seen > 1 || (deadline.has_value() && std::chrono::steady_clock::now() > deadline.value())) {
+				force_exit();
+			}
+		}
+	}
+
+   public:
+	ShutdownSignals(CancellationToken& token, std::chrono::milliseconds grace) : _token(token), _grace(grace) {
+		_received = 0;
+		if (pipe2(_pipe, O_CLOEXEC | O_NONBLOCK) != 0) {
+			error_log()->error("ShutdownSignals: could not create a pipe, signals will not stop gracefully");
+			return;
+		}
+
+		std::signal(SIGINT, handle);
+		std::signal(SIGTERM, handle);
+		_thread = std::thread{[this]() {
+			run();
+		}};
+	}
+
+	ShutdownSignals(const ShutdownSignals&) = delete;
+	ShutdownSignals& operator=(const ShutdownSignals&) = delete;
+
+	~ShutdownSignals() {
+		std::signal(SIGINT, SIG_DFL);
+		std::signal(SIGTERM, SIG_DFL);
+
+		_stop = true;
+		if (_thread.joinable()) {
+			_thread.join();
+		}
+
+		for (auto& fd : _pipe) {
+			if (fd >= 0) {
+				close(fd);
+				fd = -1;
+			}
+		}
+	}
+
+	void on_force(std::function<void()> force) {
+		std::lock_guard lock{_mutex};
+		_force = std::move(force);
+	}
+};
+
+TEST_CASE("ShutdownSignals") {
+	CancellationToken token{};
+	ShutdownSignals signals{token, std::chrono::seconds(30)};
+
+	std::raise(SIGINT);
+	CHECK(!token.sleep_for(std::chrono::seconds(5)));
+	CHECK(token.cancelled());
+}
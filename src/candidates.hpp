@@ -0,0 +1,273 @@
+/*
+Copyright 2023 larkwiot
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+		http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <chrono>
+#include <cmath>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <ctre.hpp>
+
+#include "book.hpp"
+#include "test.hpp"
+#include "util.hpp"
+
+#pragma once
+
+struct IsbnCandidate {
+	ISBN isbn{};
+	double score{};
+	std::size_t first_position{};
+	std::size_t occurrences{};
+};
+
+static constexpr std::array<std::string_view, 8> ebook_qualifiers = {"ebook", "e-book", "electronic", "epub",
+																	 "pdf",	  "kindle", "digital",	  "e-isbn"};
+static constexpr std::array<std::string_view, 7> print_qualifiers = {"print",	  "paperback", "hardcover", "hardback",
+																	 "pbk", "hbk",		 "cloth"};
+
+std::string lowercase(std::string_view text) {
+	std::string lowered{text};
+	std::transform(lowered.begin(), lowered.end(), lowered.begin(), [](unsigned char c) {
+		return static_cast<char>(std::tolower(c));
+	});
+	return lowered;
+}
+
+// How much the text around one occurrence suggests it is the book's own ISBN rather than one it cites
+double context_score(std::string_view text, std::size_t position, std::size_t length) {
+	static constexpr std::size_t label_distance = 24;
+	static constexpr std::size_t qualifier_distance = 40;
+
+	const auto label_start = position > label_distance ? position - label_distance : 0;
+	const auto before = lowercase(text.substr(label_start, position - label_start));
+
+	const auto context_start = position > qualifier_distance ? position - qualifier_distance : 0;
+	const auto around = lowercase(text.substr(context_start, position - context_start + length + qualifier_distance));
+
+	double score = 0.0;
+
+	if (before.find("isbn") != std::string::npos) {
+		score += 4.0;
+	}
+
+	auto mentions = [&around](const auto& qualifiers) {
+		return std::any_of(qualifiers.begin(), qualifiers.end(), [&around](std::string_view qualifier) {
+			return around.find(qualifier) != std::string::npos;
+		});
+	};
+
+	// the file being scanned is an ebook, so its own edition is the better guess, but any edition beats none
+	if (mentions(ebook_qualifiers)) {
+		score += 1.0;
+	} else if (mentions(print_qualifiers)) {
+		score += 0.5;
+	}
+
+	return score;
+}
+
+// Finds every valid ISBN in text and orders them by how likely each is to identify the book itself: labelled "ISBN",
+// near the front (the copyright page), qualified as an edition, and repeated. Highest score first.
+std::vector<IsbnCandidate> rank_isbn_candidates(std::string_view text) {
+	std::unordered_map<ISBN, IsbnCandidate> candidates{};
+	std::unordered_map<ISBN, double> best_context{};
+
+	for (auto match : ctre::range<isbn_pattern>(text)) {
+		const auto found = match.view();
+		const auto result = is_valid_isbn(std::string{found});
+		if (!get<0>(result)) {
+			continue;
+		}
+
+		const ISBN isbn = get<1>(result);
+		const auto position = static_cast<std::size_t>(found.data() - text.data());
+
+		auto [candidate, inserted] = candidates.try_emplace(isbn, IsbnCandidate{isbn, 0.0, position, 0});
+		candidate->second.occurrences++;
+
+		auto& context = best_context[isbn];
+		context = std::max(context, context_score(text, position, found.size()));
+	}
+
+	std::vector<IsbnCandidate> ranked{};
+	ranked.reserve(candidates.size());
+
+	const auto length = static_cast<double>(std::max<std::size_t>(text.size(), 1));
+	for (auto& [isbn, candidate] : candidates) {
+		const auto nearness_to_front = 1.0 - static_cast<double>(candidate.first_position) / length;
+		candidate.score = best_context[isbn] + 2.0 * nearness_to_front +
+						  std::log2(static_cast<double>(candidate.occurrences));
+		ranked.push_back(candidate);
+	}
+
+	std::sort(ranked.begin(), ranked.end(), [](const IsbnCandidate& a, const IsbnCandidate& b) {
+		if (a.score != b.score) {
+			return a.score > b.score;
+		}
+		return a.first_position < b.first_position;
+	});
+
+	return ranked;
+}
+
+TEST_CASE("rank_isbn_candidates()") {
+	SUBCASE("labelled copyright page ISBN beats bibliography") {
+		const std::string text =
+			"Copyright 2012. ISBN: 978-0-7356-8293-1 (ebook)\n"
+			"... lots of text ...\n"
+			"Also by this author: 9780672328978 and 9781447123309";
+		const auto ranked = rank_isbn_candidates(text);
+		REQUIRE(ranked.size() == 3);
+		CHECK(ranked[0].isbn == 9780735682931ul);
+		CHECK(ranked[1].isbn == 9780672328978ul);
+	}
+
+	SUBCASE("repetition counts") {
+		const std::string text = "9780672328978 text 9781447123309 text 9781447123309 text 9781447123309";
+		const auto ranked = rank_isbn_candidates(text);
+		REQUIRE(ranked.size() == 2);
+		CHECK(ranked[0].isbn == 9781447123309ul);
+		CHECK(ranked[0].occurrences == 3);
+	}
+
+	SUBCASE("invalid numbers are dropped") {
+		CHECK(rank_isbn_candidates("call 555 1234 or 9780735682932").empty());
+	}
+}
+
+// Skipped by default, run with --no-skip --test-case="benchmark*" to time ISBN extraction on a fixed text, e.g. to
+// compare builds with and without debug logging compiled in
+TEST_CASE("benchmark: rank_isbn_candidates() and is_valid_isbn()" * doctest::skip()) {
+	// a copyright page and bibliography, plus phone numbers, prices and misprinted ISBNs that fail validation
+	std::string text{};
+	for (int page = 0; page < 100; page++) {
+		text += fmt::format("Page {}. Copyright 2012. ISBN: 978-0-7356-8293-1 (ebook). Call 555 1234 or 0-306-40615-2. "
+							"Also by this author: 9780672328978, 978-1-4471-2330-9 and 0-306-40615-X. Only $19.99.\n",
+							page);
+	}
+	const std::vector<std::string> raw = {"978-0-7356-8293-1", "9780735682932", "0-306-40615-2", "0-306-40615-X",
+										  "0-3X6-40615-2",	   "1111111111",	"978-1-4471-2330-9"};
+
+	constexpr int rounds = 20;
+	std::size_t found = 0;
+	auto start = std::chrono::steady_clock::now();
+	for (int round = 0; round < rounds; round++) {
+		found += rank_isbn_candidates(text).size();
+	}
+	const std::chrono::duration<double, std::milli> ranking = std::chrono::steady_clock::now() - start;
+
+	constexpr int validations = 100000;
+	std::size_t valid = 0;
+	start = std::chrono::steady_clock::now();
+	for (int i = 0; i < validations; i++) {
+		valid += get<0>(is_valid_isbn(raw[static_cast<std::size_t>(i) % raw.size()])) ? 1 : 0;
+	}
+	const std::chrono::duration<double, std::nano> validating = std::chrono::steady_clock::now() - start;
+
+	CHECK(found == rounds * 4);
+	MESSAGE(fmt::format("rank_isbn_candidates(): {:.3f} ms per {} KiB of text", ranking.count() / rounds,
+						text.size() / 1024));
+	MESSAGE(fmt::format("is_valid_isbn(): {:.0f} ns per call, {} valid", validating.count() / validations, valid));
+}
+
+std::vector<std::string> normalized_words(std::string_view text) {
+	std::string cleaned = lowercase(text);
+	std::replace_if(
+		cleaned.begin(), cleaned.end(),
+		[](unsigned char c) {
+			return !std::isalnum(c);
+		},
+		' ');
+
+	std::vector<std::string> words{};
+	std::istringstream stream{cleaned};
+	for (std::string word; stream >> word;) {
+		words.push_back(word);
+	}
+	return words;
+}
+
+// Fraction of the title's significant words that also appear in the filename. Filenames usually carry extra text
+// (author, publisher, year) so this is more forgiving than an edit distance.
+double title_match_score(const std::string& title, const std::string& filename) {
+	const auto filename_words = normalized_words(filename);
+	const std::unordered_set<std::string> available{filename_words.begin(), filename_words.end()};
+
+	std::size_t significant = 0;
+	std::size_t matched = 0;
+	for (const auto& word : normalized_words(title)) {
+		if (word.size() < 3) {
+			continue;
+		}
+		significant++;
+		matched += available.contains(word) ? 1 : 0;
+	}
+
+	if (significant == 0) {
+		return 0.0;
+	}
+
+	return static_cast<double>(matched) / static_cast<double>(significant);
+}
+
+TEST_CASE("title_match_score()") {
+	CHECK(title_match_score("Inside Windows Debugging", "Soulami - Inside_Windows_Debugging (2012).pdf") == 1.0);
+	CHECK(title_match_score("Inside Windows Debugging", "windows internals.pdf") == doctest::Approx(1.0 / 3.0));
+	CHECK(title_match_score("C", "c.pdf") == 0.0);
+}
+
+// The work whose title best matches the filename: highest title_match_score() first, so a work that matched
+// confidently is never passed over for one looked up earlier, then the closest whole title, then the lowest ISBN so
+// the pick does not depend on the set's order. books must not be empty.
+const Book& best_title_match(const std::unordered_set<Book>& books, const std::string& filename) {
+	// lower is better in every field
+	using Rank = std::tuple<double, std::size_t, unsigned long>;
+
+	const Book* best = nullptr;
+	Rank best_rank{};
+	for (const auto& book : books) {
+		const Rank rank{
+			-title_match_score(book.title, filename), levenshtein_distance(book.title, filename), book.isbn};
+		if (best == nullptr || rank < best_rank) {
+			best = &book;
+			best_rank = rank;
+		}
+	}
+	return *best;
+}
+
+TEST_CASE("best_title_match()") {
+	const std::string filename = "Soulami - Inside_Windows_Debugging (2012).pdf";
+	// a title that only partly matches can still be closer to the filename by edit distance than the right one
+	const std::unordered_set<Book> books{
+		Book{9780672328978ul, "", "Soulami - Outside Windows Debugging (2012)", 0, 0, ""},
+		Book{9780735662780ul, "Tarik Soulami", "Inside Windows Debugging", 2012, 2012, ""}};
+	CHECK(best_title_match(books, filename).isbn == 9780735662780ul);
+
+	// equal scores fall back to the edit distance
+	const std::unordered_set<Book> unmatched{Book{1ul, "", "zzzzzzzzzzzzzzzzzzzz", 0, 0, ""},
+											 Book{2ul, "", "yyy", 0, 0, ""}};
+	CHECK(best_title_match(unmatched, "abc.pdf").isbn == 2ul);
+}
@@ -0,0 +1,583 @@
+/*
+Copyright 2023 larkwiot
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+		http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include <algorithm>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <ctre.hpp>
+
+#include "archive.hpp"
+#include "cancellation.hpp"
+#include "candidates.hpp"
+#include "log.hpp"
+#include "sniff.hpp"
+#include "test.hpp"
+#include "util.hpp"
+
+#pragma once
+
+// how much of the start and of the end of a PDF is searched for its XMP packet and Info dictionary
+static constexpr std::size_t pdf_metadata_window = 64 * 1024;
+// how much of an EPUB's container.xml and OPF is read, the metadata comes before the (possibly long) manifest
+static constexpr std::size_t epub_xml_limit = 256 * 1024;
+// how much of a MOBI's first record is read, its EXTH header follows the MOBI header right at the start
+static constexpr std::size_t mobi_record_window = 16 * 1024;
+
+template <typename T>
+T big_endian(std::string_view bytes, std::size_t offset) {
+	T value = 0;
+	for (std::size_t i = 0; i < sizeof(T); i++) {
+		value = static_cast<T>((value << 8) | static_cast<unsigned char>(bytes[offset + i]));
+	}
+	return value;
+}
+
+std::string strip_xml_tags(std::string_view xml) {
+	std::string text{};
+	bool in_tag = false;
+	for (auto c : xml) {
+		if (c == '<' || c == '>') {
+			in_tag = c == '<';
+			text += ' ';
+		} else if (!in_tag) {
+			text += c;
+		}
+	}
+	return text;
+}
+
+// The contents of elements and the values of attributes whose name, namespace prefix aside, is local_name (in lower
+// case, matched ignoring case). Enough for the small machine-written XML that ebooks keep their metadata in and
+// tolerant of it being cut short, but not a general XML parser.
+std::vector<std::string> xml_values(std::string_view xml, std::string_view local_name) {
+	auto matches = [local_name](std::string_view name) {
+		const auto colon = name.rfind(':');
+		return lowercase(colon == std::string_view::npos ? name : name.substr(colon + 1)) == local_name;
+	};
+
+	std::vector<std::string> values{};
+	for (auto position = xml.find('<'); position != std::string_view::npos; position = xml.find('<', position + 1)) {
+		if (position + 1 >= xml.size() || xml[position + 1] == '/' || xml[position + 1] == '?' ||
+			xml[position + 1] == '!') {
+			continue;
+		}
+		const auto tag_end = xml.find('>', position);
+		if (tag_end == std::string_view::npos) {
+			break;
+		}
+
+		const auto tag = xml.substr(position + 1, tag_end - position - 1);
+		const auto name = tag.substr(0, tag.find_first_of(" \t\r\n/"));
+
+		// attributes are name="value" or name='value'
+		for (auto equals = tag.find('='); equals != std::string_view::npos; equals = tag.find('=', equals + 1)) {
+			const auto before = tag.substr(0, tag.find_last_not_of(" \t\r\n", equals - 1) + 1);
+			const auto attribute = before.substr(before.find_last_of(" \t\r\n") + 1);
+			const auto quote = tag.find_first_of("\"'", equals);
+			if (quote == std::string_view::npos) {
+				break;
+			}
+			const auto value_end = tag.find(tag[quote], quote + 1);
+			if (value_end == std::string_view::npos) {
+				break;
+			}
+			if (matches(attribute)) {
+				values.emplace_back(tag.substr(quote + 1, value_end - quote - 1));
+			}
+			equals = value_end;
+		}
+
+		if (matches(name) && !tag.ends_with('/')) {
+			const auto closing = xml.find(fmt::format("</{}", name), tag_end);
+			values.push_back(strip_xml_tags(xml.substr(tag_end + 1, closing == std::string_view::npos
+																		   ? std::string_view::npos
+																		   : closing - tag_end - 1)));
+		}
+		position = tag_end;
+	}
+	return values;
+}
+
+// Adds the valid ISBNs in one metadata value to found, skipping ones found before. Identifiers that say they are
+// something else entirely (a UUID can contain a digit run that happens to pass the checksum) are ignored.
+void add_declared_isbns(std::string_view value, std::vector<IsbnCandidate>& found) {
+	if (lowercase(value).find("uuid") != std::string::npos) {
+		return;
+	}
+
+	for (auto match : ctre::range<isbn_pattern>(value)) {
+		const auto result = is_valid_isbn(std::string{match.view()});
+		if (!get<0>(result)) {
+			continue;
+		}
+
+		const ISBN isbn = get<1>(result);
+		const bool known = std::any_of(found.begin(), found.end(), [isbn](const IsbnCandidate& candidate) {
+			return candidate.isbn == isbn;
+		});
+		if (!known) {
+			found.push_back(IsbnCandidate{isbn, 0.0, found.size(), 1});
+		}
+	}
+}
+
+// dc:identifier from the OPF package document that META-INF/container.xml points to, then dc:source, which is often
+// the print edition's ISBN
+std::vector<IsbnCandidate> epub_isbns(const ReadAt& read_at, std::uint64_t size) {
+	const auto members = list_zip_members(read_at, size);
+	if (!members) {
+		return {};
+	}
+
+	auto read_member = [&](std::string_view name) -> std::string {
+		const auto member = std::find_if(members->begin(), members->end(), [name](const ArchiveMember& member) {
+			return member.name == name;
+		});
+		if (member == members->end()) {
+			return "";
+		}
+		return read_zip_member(read_at, *member, epub_xml_limit).bytes;
+	};
+
+	const auto rootfiles = xml_values(read_member("META-INF/container.xml"), "full-path");
+	if (rootfiles.empty()) {
+		return {};
+	}
+	const auto opf = read_member(rootfiles.front());
+
+	std::vector<IsbnCandidate> found{};
+	for (const auto element : {"identifier", "source"}) {
+		for (const auto& value : xml_values(opf, element)) {
+			add_declared_isbns(value, found);
+		}
+	}
+	return found;
+}
+
+// A decoded PDF text string as ASCII, UTF-16BE ones (marked by a byte order mark) with anything beyond ASCII as spaces
+std::string pdf_text_ascii(std::string value) {
+	if (!value.starts_with("\xfe\xff")) {
+		return value;
+	}
+	std::string ascii{};
+	for (std::size_t i = 2; i + 1 < value.size(); i += 2) {
+		const auto c = static_cast<unsigned char>(value[i + 1]);
+		ascii += value[i] == '\0' && c < 0x80 ? static_cast<char>(c) : ' ';
+	}
+	return ascii;
+}
+
+// Literal string values of the Info dictionary entries named key, e.g. /ISBN (978-0-7356-8293-1), escapes decoded
+std::vector<std::string> pdf_info_values(std::string_view bytes, std::string_view key) {
+	std::vector<std::string> values{};
+	for (auto position = bytes.find(key); position != std::string_view::npos;
+		 position = bytes.find(key, position + 1)) {
+		auto start = position + key.size();
+		while (start < bytes.size() && (bytes[start] == ' ' || bytes[start] == '\r' || bytes[start] == '\n')) {
+			start++;
+		}
+		if (start >= bytes.size() || bytes[start] != '(') {
+			continue;
+		}
+
+		// balanced parentheses may appear unescaped inside a literal string
+		std::string value{};
+		int depth = 1;
+		for (auto i = start + 1; i < bytes.size() && depth > 0; i++) {
+			const auto c = bytes[i];
+			if (c == '\\' && i + 1 < bytes.size()) {
+				const auto escaped = bytes[++i];
+				switch (escaped) {
+					case 'n':
+						value += '\n';
+						break;
+					case 'r':
+						value += '\r';
+						break;
+					case 't':
+						value += '\t';
+						break;
+					case 'b':
+						value += '\b';
+						break;
+					case 'f':
+						value += '\f';
+						break;
+					case '\r':
+						// a line continuation, as is a backslash before \n or \r\n
+						if (i + 1 < bytes.size() && bytes[i + 1] == '\n') {
+							i++;
+						}
+						break;
+					case '\n':
+						break;
+					default:
+						if (escaped < '0' || escaped > '7') {
+							value += escaped;
+							break;
+						}
+						// up to three octal digits
+						unsigned code = 0;
+						const auto end = std::min(i + 3, bytes.size());
+						for (; i < end && bytes[i] >= '0' && bytes[i] <= '7'; i++) {
+							code = code * 8 + static_cast<unsigned>(bytes[i] - '0');
+						}
+						i--;
+						value += static_cast<char>(code & 0xff);
+				}
+				continue;
+			}
+			depth += c == '(' ? 1 : c == ')' ? -1 : 0;
+			if (depth > 0) {
+				value += c;
+			}
+		}
+		values.push_back(pdf_text_ascii(std::move(value)));
+	}
+	return values;
+}
+
+// The XMP packet (prism:isbn, pdfx:ISBN, dc:identifier and such) and then the Info dictionary, in whichever of the
+// start and end of the file they are. Metadata only found inside compressed object streams is missed.
+std::vector<IsbnCandidate> pdf_isbns(const ReadAt& read_at, std::uint64_t size) {
+	const auto window = static_cast<std::size_t>(std::min<std::uint64_t>(size, pdf_metadata_window));
+
+	std::vector<std::string> chunks{};
+	if (auto head = read_at(0, window)) {
+		chunks.push_back(std::move(head.value()));
+	}
+	if (size > window) {
+		if (auto tail = read_at(size - window, window)) {
+			chunks.push_back(std::move(tail.value()));
+		}
+	}
+
+	std::vector<IsbnCandidate> found{};
+	for (const auto& chunk : chunks) {
+		const std::string_view bytes{chunk};
+		const auto xmp_start = bytes.find("<x:xmpmeta");
+		if (xmp_start == std::string_view::npos) {
+			continue;
+		}
+		const auto xmp = bytes.substr(xmp_start, bytes.find("</x:xmpmeta>", xmp_start) - xmp_start);
+		for (const auto name : {"isbn", "identifier"}) {
+			for (const auto& value : xml_values(xmp, name)) {
+				add_declared_isbns(value, found);
+			}
+		}
+	}
+
+	for (const auto& chunk : chunks) {
+		for (const auto key : {"/ISBN", "/EBX_ISBN"}) {
+			for (const auto& value : pdf_info_values(chunk, key)) {
+				add_declared_isbns(value, found);
+			}
+		}
+		// free text, so only taken when it says what the number is
+		for (const auto key : {"/Subject", "/Keywords"}) {
+			for (const auto& value : pdf_info_values(chunk, key)) {
+				if (lowercase(value).find("isbn") != std::string::npos) {
+					add_declared_isbns(value, found);
+				}
+			}
+		}
+	}
+	return found;
+}
+
+// EXTH record 104 from the header of the PalmDB's first record
+std::vector<IsbnCandidate> mobi_isbns(const ReadAt& read_at, std::uint64_t size) {
+	static constexpr std::size_t palm_header_size = 78;
+	static constexpr std::uint32_t exth_isbn = 104;
+
+	const auto header = read_at(0, palm_header_size + 4);
+	if (!header || big_endian<std::uint16_t>(header.value(), 76) == 0) {
+		return {};
+	}
+
+	const std::uint64_t record_offset = big_endian<std::uint32_t>(header.value(), palm_header_size);
+	if (record_offset >= size) {
+		return {};
+	}
+	const auto record_length =
+		static_cast<std::size_t>(std::min<std::uint64_t>(mobi_record_window, size - record_offset));
+	const auto record = read_at(record_offset, record_length);
+	// a 16 byte PalmDOC header, then the MOBI header with its own length, then EXTH
+	if (!record || record->size() < 24 || record->substr(16, 4) != "MOBI") {
+		return {};
+	}
+	const std::string_view bytes{record.value()};
+
+	const std::size_t exth = 16 + big_endian<std::uint32_t>(bytes, 20);
+	if (exth + 12 > bytes.size() || bytes.substr(exth, 4) != "EXTH") {
+		return {};
+	}
+
+	std::vector<IsbnCandidate> found{};
+	const auto count = big_endian<std::uint32_t>(bytes, exth + 8);
+	auto position = exth + 12;
+	for (std::uint32_t i = 0; i < count && position + 8 <= bytes.size(); i++) {
+		const auto type = big_endian<std::uint32_t>(bytes, position);
+		const auto length = big_endian<std::uint32_t>(bytes, position + 4);
+		if (length < 8 || position + length > bytes.size()) {
+			break;
+		}
+		if (type == exth_isbn) {
+			add_declared_isbns(bytes.substr(position + 8, length - 8), found);
+		}
+		position += length;
+	}
+	return found;
+}
+
+// The valid ISBNs a file declares in its own metadata, in the order found. Only the structures holding that metadata
+// are read, usually a few KB, so a hit saves reading the whole file and extracting its text.
+std::vector<IsbnCandidate> find_embedded_isbns(FileKind kind, const ReadAt& read_at, std::uint64_t size) {
+	switch (kind) {
+		case FileKind::epub:
+			return epub_isbns(read_at, size);
+		case FileKind::pdf:
+			return pdf_isbns(read_at, size);
+		case FileKind::mobi:
+			return mobi_isbns(read_at, size);
+		default:
+			return {};
+	}
+}
+
+// Whether files sent as mime_type nearly always declare ISBNs that find_embedded_isbns() reads, and so are rarely read
+// whole. PDFs can declare them too but seldom do, most of them end up extracted by Tika all the same.
+bool usually_declares_isbns(std::string_view mime_type) {
+	for (const auto kind : {FileKind::epub, FileKind::mobi}) {
+		if (sniffed_mime_type(kind) == mime_type) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// find_embedded_isbns() for a file on disk, reading only the parts its metadata is in. Reads that fall within head, the
+// start of the file already read to sniff it, are served from it, and as the others block the worker each one first
+// checks for cancellation.
+std::vector<IsbnCandidate> find_embedded_isbns_in_file(const std::string& fn,
+													   FileKind kind,
+													   std::string_view head,
+													   const CancellationToken& cancellation) {
+	if (kind != FileKind::epub && kind != FileKind::pdf && kind != FileKind::mobi) {
+		return {};
+	}
+
+	std::error_code error{};
+	const auto size = std::filesystem::file_size(fn, error);
+	if (error || cancellation.cancelled()) {
+		return {};
+	}
+
+	// opened on the first read past head, which for a small file may never come
+	std::optional<int> fd{};
+	const ReadAt read_at = [&](std::uint64_t offset, std::size_t length) -> std::optional<std::string> {
+		if (offset <= head.size() && length <= head.size() - offset) {
+			return std::string{head.substr(static_cast<std::size_t>(offset), length)};
+		}
+		if (cancellation.cancelled()) {
+			return std::nullopt;
+		}
+		if (!fd.has_value()) {
+			fd = open(fn.c_str(), O_RDONLY | O_CLOEXEC);
+		}
+		return fd.value() < 0 ? std::nullopt : pread_exact(fd.value(), offset, length);
+	};
+
+	auto found = find_embedded_isbns(kind, read_at, size);
+	if (fd.has_value() && fd.value() >= 0) {
+		close(fd.value());
+	}
+	return found;
+}
+
+TEST_CASE("xml_values()") {
+	const auto xml = R"(<?xml version="1.0"?><package unique-identifier="id"><metadata>
+		<dc:identifier id="id" opf:scheme="ISBN">urn:isbn:978-0-7356-8293-1</dc:identifier>
+		<DC:Identifier>second</DC:Identifier><meta property='identifier' content="x"/><identifier/>
+		<rdf:Description prism:isbn="9780672328978"/><pdfx:ISBN><rdf:li>0071466932</rdf:li></pdfx:ISBN>
+		</metadata></package>)";
+
+	const auto identifiers = xml_values(xml, "identifier");
+	REQUIRE(identifiers.size() == 2);
+	CHECK(identifiers[0] == "urn:isbn:978-0-7356-8293-1");
+	CHECK(identifiers[1] == "second");
+
+	const auto isbns = xml_values(xml, "isbn");
+	REQUIRE(isbns.size() == 2);
+	CHECK(isbns[0] == "9780672328978");
+	CHECK(isbns[1].find("0071466932") != std::string::npos);
+
+	// cut off mid-element
+	CHECK(xml_values("<dc:identifier>9780735682931", "identifier").front() == "9780735682931");
+	CHECK(xml_values("", "identifier").empty());
+}
+
+TEST_CASE("find_embedded_isbns()") {
+	using namespace std::string_literals;
+
+	auto u16 = [](std::uint16_t value) {
+		return std::string{static_cast<char>(value & 0xff), static_cast<char>(value >> 8)};
+	};
+	auto u32 = [&u16](std::uint32_t value) {
+		return u16(static_cast<std::uint16_t>(value & 0xffff)) + u16(static_cast<std::uint16_t>(value >> 16));
+	};
+	auto be32 = [](std::uint32_t value) {
+		return std::string{static_cast<char>(value >> 24), static_cast<char>((value >> 16) & 0xff),
+						   static_cast<char>((value >> 8) & 0xff), static_cast<char>(value & 0xff)};
+	};
+
+	{
+		const std::vector<std::pair<std::string, std::string>> entries{
+			{"mimetype", "application/epub+zip"},
+			{"META-INF/container.xml",
+			 R"(<container><rootfiles><rootfile full-path="OEBPS/content.opf"/></rootfiles></container>)"},
+			{"OEBPS/content.opf",
+			 R"(<package><metadata><dc:identifier>urn:uuid:9780735682931-0000</dc:identifier>
+			 <dc:identifier opf:scheme="ISBN">9780672328978</dc:identifier><dc:source>ISBN 0071466932</dc:source>
+			 <dc:identifier>978-0-672-32897-8</dc:identifier></metadata></package>)"}};
+
+		std::string zip{};
+		std::string directory{};
+		for (const auto& [name, data] : entries) {
+			const auto offset = static_cast<std::uint32_t>(zip.size());
+			const auto sizes = u32(0) + u32(static_cast<std::uint32_t>(data.size())) +
+							   u32(static_cast<std::uint32_t>(data.size())) +
+							   u16(static_cast<std::uint16_t>(name.size())) + u16(0);
+			zip += "PK\x03\x04"s + u16(20) + u16(0) + u16(0) + u32(0) + sizes + name + data;
+			directory += "PK\x01\x02"s + u16(20) + u16(20) + u16(0) + u16(0) + u32(0) + sizes + u16(0) + u16(0) +
+						 u16(0) + u32(0) + u32(offset) + name;
+		}
+		const auto directory_offset = static_cast<std::uint32_t>(zip.size());
+		zip += directory + "PK\x05\x06"s + u16(0) + u16(0) + u16(3) + u16(3) +
+			   u32(static_cast<std::uint32_t>(directory.size())) + u32(directory_offset) + u16(0);
+
+		REQUIRE(sniff_file_kind(zip) == FileKind::epub);
+		const auto found = find_embedded_isbns(FileKind::epub, read_at_buffer(zip), zip.size());
+		REQUIRE(found.size() == 2);
+		CHECK(found[0].isbn == 9780672328978ul);
+		CHECK(found[1].isbn == 71466932ul);
+	}
+
+	{
+		const auto xmp = R"(<x:xmpmeta xmlns:x="adobe:ns:meta/"><rdf:RDF><rdf:Description prism:isbn="9781447123309">
+			<dc:identifier>not an isbn</dc:identifier></rdf:Description></rdf:RDF></x:xmpmeta>)"s;
+		const auto info = "1 0 obj << /Title (A \\(very\\) good book) /ISBN (978-0-7356-8293-1) >> endobj "s +
+						  "2 0 obj << /Keywords (9780672328978) /Subject (e-ISBN: 0071466932) >> endobj";
+
+		const auto small = "%PDF-1.7\n" + xmp + info + "\n%%EOF";
+		const auto found = find_embedded_isbns(FileKind::pdf, read_at_buffer(small), small.size());
+		REQUIRE(found.size() == 3);
+		CHECK(found[0].isbn == 9781447123309ul);
+		CHECK(found[1].isbn == 9780735682931ul);
+		CHECK(found[2].isbn == 71466932ul);
+
+		// the Info dictionary at the end of a large file is found without reading what is in between
+		const auto large = "%PDF-1.7\n" + std::string(3 * pdf_metadata_window, 'x') + info;
+		std::size_t read_bytes = 0;
+		const auto counting = [&large, &read_bytes](std::uint64_t offset, std::size_t length) {
+			read_bytes += length;
+			return read_at_buffer(large)(offset, length);
+		};
+		const auto tail = find_embedded_isbns(FileKind::pdf, counting, large.size());
+		REQUIRE(tail.size() == 2);
+		CHECK(tail[0].isbn == 9780735682931ul);
+		CHECK(read_bytes == 2 * pdf_metadata_window);
+
+		CHECK(find_embedded_isbns(FileKind::pdf, read_at_buffer("%PDF-1.4 no metadata"), 20).empty());
+
+		// text strings as some producers write them, UTF-16 with every byte an octal escape
+		std::string utf16 = "\\376\\377";
+		for (const auto c : "978-0-596-52068-7"s) {
+			utf16 += fmt::format("\\000\\{:03o}", c);
+		}
+		const auto escaped = "%PDF-1.6\n<< /EBX_ISBN (" + utf16 + ") /Title (one\\ntwo\\\n three\\t\\50) >>";
+		const auto decoded = find_embedded_isbns(FileKind::pdf, read_at_buffer(escaped), escaped.size());
+		REQUIRE(decoded.size() == 1);
+		CHECK(decoded[0].isbn == 9780596520687ul);
+		CHECK(pdf_info_values(escaped, "/Title") == std::vector<std::string>{"one\ntwo three\t("});
+
+		const auto path =
+			std::filesystem::temp_directory_path() / fmt::format("isbn_scanner_embedded_{}.pdf", getpid());
+		{
+			std::ofstream fh(path, std::ios::binary);
+			fh << large;
+		}
+		CancellationToken running{};
+		const std::string_view head = std::string_view{large}.substr(0, sniff_length);
+		CHECK(find_embedded_isbns_in_file(path.string(), FileKind::pdf, head, running).size() == 2);
+		CHECK(find_embedded_isbns_in_file(path.string(), FileKind::ole, head, running).empty());
+
+		CancellationToken cancelled{};
+		cancelled.cancel();
+		CHECK(find_embedded_isbns_in_file(path.string(), FileKind::pdf, head, cancelled).empty());
+
+		// a file that fits in its head is not read again
+		{
+			std::ofstream fh(path, std::ios::binary | std::ios::trunc);
+			fh << std::string(small.size(), 'x');
+		}
+		CHECK(find_embedded_isbns_in_file(path.string(), FileKind::pdf, small, running).size() == 3);
+
+		std::filesystem::remove(path);
+		CHECK(find_embedded_isbns_in_file(path.string(), FileKind::pdf, head, running).empty());
+	}
+
+	CHECK(usually_declares_isbns("application/epub+zip"));
+	CHECK(usually_declares_isbns("application/x-mobipocket-ebook"));
+	CHECK(!usually_declares_isbns("application/pdf"));
+	CHECK(!usually_declares_isbns("application/msword"));
+	CHECK(!usually_declares_isbns(""));
+
+	{
+		auto exth_record = [&be32](std::uint32_t type, const std::string& data) {
+			return be32(type) + be32(static_cast<std::uint32_t>(data.size() + 8)) + data;
+		};
+		const auto records = exth_record(100, "An Author") + exth_record(104, "978-1-4471-2330-9");
+		const auto exth = "EXTH"s + be32(static_cast<std::uint32_t>(records.size() + 12)) + be32(2) + records;
+		const std::uint32_t mobi_length = 232;
+		const auto record0 =
+			std::string(16, '\0') + "MOBI" + be32(mobi_length) + std::string(mobi_length - 8, '\0') + exth;
+
+		const std::uint32_t record_offset = 78 + 8 + 2;
+		const auto mobi = std::string(60, '\0') + "BOOKMOBI" + std::string(8, '\0') + "\x00\x01"s +
+						  be32(record_offset) + be32(0) + "\0\0"s + record0;
+		REQUIRE(mobi.size() == record_offset + record0.size());
+		REQUIRE(sniff_file_kind(mobi) == FileKind::mobi);
+
+		const auto found = find_embedded_isbns(FileKind::mobi, read_at_buffer(mobi), mobi.size());
+		REQUIRE(found.size() == 1);
+		CHECK(found[0].isbn == 9781447123309ul);
+
+		const auto truncated = mobi.substr(0, record_offset + 100);
+		CHECK(find_embedded_isbns(FileKind::mobi, read_at_buffer(truncated), truncated.size()).empty());
+	}
+
+	CHECK(find_embedded_isbns(FileKind::docx, read_at_buffer("PK"), 2).empty());
+}
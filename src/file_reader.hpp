@@ -0,0 +1,659 @@
+/*
+Copyright 2023 larkwiot
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+		http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <future>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <cerrno>
+
+#include <magic_enum.hpp>
+#include <spdlog/spdlog.h>
+
+#include "log.hpp"
+#include "test.hpp"
+
+#pragma once
+
+enum class ReadError {
+	none,
+	open_failed,
+	stat_failed,
+	not_a_file,
+	read_failed,
+};
+
+// The contents of one file, or why they could not be read. Failures only ever concern this one file.
+struct FileRead {
+	std::string bytes;
+	ReadError error = ReadError::none;
+	int error_number{};
+
+	explicit operator bool() const {
+		return error == ReadError::none;
+	}
+
+	std::string describe() const {
+		return fmt::format("{}: {}", magic_enum::enum_name(error), std::strerror(error_number));
+	}
+
+	static FileRead failed(ReadError error, int error_number) {
+		return FileRead{"", error, error_number};
+	}
+};
+
+// opens fn and sizes a buffer for it (or its first max_length bytes), shared by every way of reading
+FileRead open_for_read(const std::string& fn, int& fd, std::size_t max_length = std::numeric_limits<std::size_t>::max()) {
+	fd = open(fn.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return FileRead::failed(ReadError::open_failed, errno);
+	}
+
+	struct stat info {};
+	if (fstat(fd, &info) != 0) {
+		const int error_number = errno;
+		close(fd);
+		fd = -1;
+		return FileRead::failed(ReadError::stat_failed, error_number);
+	}
+
+	if (!S_ISREG(info.st_mode)) {
+		close(fd);
+		fd = -1;
+		return FileRead::failed(ReadError::not_a_file, EINVAL);
+	}
+
+	FileRead read{};
+	read.bytes.resize(std::min(static_cast<std::size_t>(info.st_size), max_length));
+	return read;
+}
+
+// fills the buffer open_for_read() sized with pread and closes fd
+FileRead read_opened(int fd, FileRead read) {
+	std::size_t offset = 0;
+	while (offset < read.bytes.size()) {
+		const auto got = pread(fd, read.bytes.data() + offset, read.bytes.size() - offset, static_cast<off_t>(offset));
+		if (got < 0 && errno == EINTR) {
+			continue;
+		}
+		if (got < 0) {
+			const int error_number = errno;
+			close(fd);
+			return FileRead::failed(ReadError::read_failed, error_number);
+		}
+		if (got == 0) {
+			// the file shrank since we looked at it
+			read.bytes.resize(offset);
+			break;
+		}
+		offset += static_cast<std::size_t>(got);
+	}
+
+	close(fd);
+	return read;
+}
+
+// Blocking read of a whole file, what the thread pool fallback runs
+FileRead read_file(const std::string& fn) {
+	int fd = -1;
+	auto read = open_for_read(fn, fd);
+	if (!read) {
+		return read;
+	}
+	return read_opened(fd, std::move(read));
+}
+
+// Blocking read of no more than the first length bytes of a file, e.g. to look at its signature
+FileRead read_file_head(const std::string& fn, std::size_t length) {
+	int fd = -1;
+	auto read = open_for_read(fn, fd, length);
+	if (!read) {
+		return read;
+	}
+	return read_opened(fd, std::move(read));
+}
+
+TEST_CASE("read_file()") {
+	const auto path = std::filesystem::temp_directory_path() / fmt::format("isbn_scanner_read_{}", getpid());
+	{
+		std::ofstream fh(path, std::ios::binary);
+		fh << "some bytes";
+	}
+
+	auto read = read_file(path.string());
+	CHECK(static_cast<bool>(read));
+	CHECK(read.bytes == "some bytes");
+
+	std::filesystem::remove(path);
+
+	auto missing = read_file(path.string());
+	CHECK(!missing);
+	CHECK(missing.error == ReadError::open_failed);
+	CHECK(missing.error_number == ENOENT);
+
+	CHECK(read_file(std::filesystem::temp_directory_path().string()).error == ReadError::not_a_file);
+}
+
+// Just enough of io_uring for batched reads, driven through the raw system calls
+class IoUring {
+	int _fd{-1};
+	io_uring_params _params{};
+
+	void* _sq_ring = MAP_FAILED;
+	std::size_t _sq_ring_size{};
+	void* _cq_ring = MAP_FAILED;
+	std::size_t _cq_ring_size{};
+	io_uring_sqe* _sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+	std::size_t _sqes_size{};
+
+	unsigned* _sq_head{};
+	unsigned* _sq_tail{};
+	unsigned* _sq_mask{};
+	unsigned* _sq_array{};
+	unsigned* _cq_head{};
+	unsigned* _cq_tail{};
+	unsigned* _cq_mask{};
+	io_uring_cqe* _cqes{};
+
+	unsigned _to_submit{};
+
+	template <typename T>
+	static T* at(void* base, std::uint32_t offset) {
+		return reinterpret_cast<T*>(static_cast<char*>(base) + offset);
+	}
+
+   public:
+	explicit IoUring(unsigned entries) {
+		_fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &_params));
+		if (_fd < 0) {
+			return;
+		}
+
+		_sq_ring_size = _params.sq_off.array + _params.sq_entries * sizeof(unsigned);
+		_cq_ring_size = _params.cq_off.cqes + _params.cq_entries * sizeof(io_uring_cqe);
+		if (_params.features & IORING_FEAT_SINGLE_MMAP) {
+			_sq_ring_size = _cq_ring_size = std::max(_sq_ring_size, _cq_ring_size);
+		}
+
+		_sq_ring = mmap(nullptr, _sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd,
+						IORING_OFF_SQ_RING);
+		if (_sq_ring == MAP_FAILED) {
+			return;
+		}
+
+		if (_params.features & IORING_FEAT_SINGLE_MMAP) {
+			_cq_ring = _sq_ring;
+		} else {
+			_cq_ring = mmap(nullptr, _cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd,
+							IORING_OFF_CQ_RING);
+			if (_cq_ring == MAP_FAILED) {
+				return;
+			}
+		}
+
+		_sqes_size = _params.sq_entries * sizeof(io_uring_sqe);
+		_sqes = static_cast<io_uring_sqe*>(
+			mmap(nullptr, _sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_SQES));
+		if (_sqes == MAP_FAILED) {
+			return;
+		}
+
+		_sq_head = at<unsigned>(_sq_ring, _params.sq_off.head);
+		_sq_tail = at<unsigned>(_sq_ring, _params.sq_off.tail);
+		_sq_mask = at<unsigned>(_sq_ring, _params.sq_off.ring_mask);
+		_sq_array = at<unsigned>(_sq_ring, _params.sq_off.array);
+		_cq_head = at<unsigned>(_cq_ring, _params.cq_off.head);
+		_cq_tail = at<unsigned>(_cq_ring, _params.cq_off.tail);
+		_cq_mask = at<unsigned>(_cq_ring, _params.cq_off.ring_mask);
+		_cqes = at<io_uring_cqe>(_cq_ring, _params.cq_off.cqes);
+	}
+
+	IoUring(const IoUring&) = delete;
+	IoUring& operator=(const IoUring&) = delete;
+
+	~IoUring() {
+		if (_sqes != MAP_FAILED) {
+			munmap(_sqes, _sqes_size);
+		}
+		if (_cq_ring != MAP_FAILED && _cq_ring != _sq_ring) {
+			munmap(_cq_ring, _cq_ring_size);
+		}
+		if (_sq_ring != MAP_FAILED) {
+			munmap(_sq_ring, _sq_ring_size);
+		}
+		if (_fd >= 0) {
+			close(_fd);
+		}
+	}
+
+	bool ok() const {
+		return _fd >= 0 && _sqes != MAP_FAILED && _cq_ring != MAP_FAILED;
+	}
+
+	unsigned capacity() const {
+		return _params.sq_entries;
+	}
+
+	// queues a readv, returns false when the submission queue is full
+	bool queue_readv(int fd, const iovec* iov, std::uint64_t offset, std::uint64_t user_data) {
+		const unsigned head = __atomic_load_n(_sq_head, __ATOMIC_ACQUIRE);
+		const unsigned tail = *_sq_tail;
+		if (tail - head >= _params.sq_entries) {
+			return false;
+		}
+
+		const unsigned index = tail & *_sq_mask;
+		auto& sqe = _sqes[index];
+		std::memset(&sqe, 0, sizeof(sqe));
+		sqe.opcode = IORING_OP_READV;
+		sqe.fd = fd;
+		sqe.addr = reinterpret_cast<std::uint64_t>(iov);
+		sqe.len = 1;
+		sqe.off = offset;
+		sqe.user_data = user_data;
+
+		_sq_array[index] = index;
+		__atomic_store_n(_sq_tail, tail + 1, __ATOMIC_RELEASE);
+		_to_submit++;
+		return true;
+	}
+
+	// submits everything queued and waits for at least wait_for completions
+	int enter(unsigned wait_for) {
+		const auto submitted = syscall(__NR_io_uring_enter, _fd, _to_submit, wait_for,
+									   wait_for > 0 ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+		if (submitted < 0) {
+			return -errno;
+		}
+		_to_submit -= static_cast<unsigned>(submitted);
+		return static_cast<int>(submitted);
+	}
+
+	bool pop(io_uring_cqe& completion) {
+		const unsigned head = *_cq_head;
+		if (head == __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE)) {
+			return false;
+		}
+
+		completion = _cqes[head & *_cq_mask];
+		__atomic_store_n(_cq_head, head + 1, __ATOMIC_RELEASE);
+		return true;
+	}
+};
+
+// Reads whole files for many workers at once. A single thread owns an io_uring and keeps reads for every requested
+// file in flight together, split into chunks so large files do not hold up small ones. Where io_uring is unavailable
+// (old kernels, seccomp), a small pool of threads does blocking preads instead.
+class FileReader {
+	static constexpr std::size_t chunk_size = 1 << 20;
+
+	struct Request {
+		std::string filepath;
+		bool prefetch_only = false;
+		std::promise<FileRead> promise{};
+	};
+
+	struct Job {
+		std::string filepath;
+		std::promise<FileRead> promise{};
+		FileRead read{};
+		// read.bytes is what chunks still in the kernel write to, so it is only touched once they are all back: a
+		// failed chunk or a file that shrank is recorded here and applied by finish()
+		std::optional<FileRead> failure{};
+		std::size_t end = std::numeric_limits<std::size_t>::max();
+		int fd{-1};
+		std::size_t outstanding{};
+		std::size_t queued_until{};
+	};
+
+	struct Chunk {
+		Job* job;
+		std::size_t offset;
+		iovec iov;
+	};
+
+	std::mutex _mutex{};
+	std::condition_variable _wake{};
+	std::deque<Request> _requests{};
+	bool _stopping = false;
+	// jobs the ring gave up on, whose buffers reads still in the kernel may write to until the ring is gone
+	std::vector<std::unique_ptr<Job>> _abandoned{};
+	std::unique_ptr<IoUring> _ring{};
+	std::atomic<bool> _ring_failed{false};
+	std::vector<std::thread> _threads{};
+
+	static void prefetch_now(const std::string& filepath) {
+		const int fd = open(filepath.c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd >= 0) {
+			posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+			close(fd);
+		}
+	}
+
+	// waits for requests only when idle, and only gives up once stopping with nothing left to do
+	bool take(std::deque<Request>& taken, bool idle) {
+		std::unique_lock lock{_mutex};
+		if (idle) {
+			_wake.wait(lock, [this]() {
+				return _stopping || !_requests.empty();
+			});
+		}
+		if (idle && _stopping && _requests.empty()) {
+			return false;
+		}
+		std::move(_requests.begin(), _requests.end(), std::back_inserter(taken));
+		_requests.clear();
+		return true;
+	}
+
+	void run_pool() {
+		for (;;) {
+			Request request;
+			{
+				std::unique_lock lock{_mutex};
+				_wake.wait(lock, [this]() {
+					return _stopping || !_requests.empty();
+				});
+				if (_requests.empty()) {
+					return;
+				}
+				request = std::move(_requests.front());
+				_requests.pop_front();
+			}
+
+			if (request.prefetch_only) {
+				prefetch_now(request.filepath);
+			} else {
+				request.promise.set_value(read_file(request.filepath));
+			}
+		}
+	}
+
+	void finish(std::unique_ptr<Job>& job) {
+		close(job->fd);
+		if (job->failure.has_value()) {
+			job->promise.set_value(std::move(job->failure.value()));
+			return;
+		}
+		job->read.bytes.resize(std::min(job->read.bytes.size(), job->end));
+		job->promise.set_value(std::move(job->read));
+	}
+
+	// Once io_uring_enter() fails for good, the jobs in progress are read again with blocking preads, as is everything
+	// requested from then on
+	void abandon_ring(std::deque<std::unique_ptr<Job>>& waiting, std::vector<std::unique_ptr<Job>>& active) {
+		_ring_failed = true;
+
+		std::move(active.begin(), active.end(), std::back_inserter(waiting));
+		active.clear();
+
+		std::lock_guard lock{_mutex};
+		for (auto& job : waiting) {
+			close(job->fd);
+			_requests.push_front(Request{job->filepath, false, std::move(job->promise)});
+			_abandoned.push_back(std::move(job));
+		}
+		waiting.clear();
+	}
+
+	void run_ring() {
+		std::deque<std::unique_ptr<Job>> waiting{};
+		std::vector<std::unique_ptr<Job>> active{};
+		std::size_t in_flight = 0;
+
+		for (;;) {
+			std::deque<Request> taken{};
+			if (!take(taken, in_flight == 0 && waiting.empty())) {
+				return;
+			}
+
+			for (auto& request : taken) {
+				if (request.prefetch_only) {
+					prefetch_now(request.filepath);
+					continue;
+				}
+
+				auto job = std::make_unique<Job>();
+				job->filepath = request.filepath;
+				job->promise = std::move(request.promise);
+				job->read = open_for_read(request.filepath, job->fd);
+				if (!job->read || job->read.bytes.empty()) {
+					if (job->fd >= 0) {
+						close(job->fd);
+					}
+					job->promise.set_value(std::move(job->read));
+					continue;
+				}
+				waiting.push_back(std::move(job));
+			}
+
+			// hand out chunks, oldest files first, for as long as the ring has room
+			while (!waiting.empty() && in_flight < _ring->capacity()) {
+				auto& job = waiting.front();
+				// a failed file gets no more reads, it is finished once the ones in flight are back
+				if (job->failure.has_value()) {
+					if (job->outstanding == 0) {
+						finish(job);
+					} else {
+						active.push_back(std::move(job));
+					}
+					waiting.pop_front();
+					continue;
+				}
+
+				const auto length = std::min(chunk_size, job->read.bytes.size() - job->queued_until);
+				auto* chunk = new Chunk{job.get(), job->queued_until, {job->read.bytes.data() + job->queued_until, length}};
+
+				if (!_ring->queue_readv(job->fd, &chunk->iov, chunk->offset, reinterpret_cast<std::uint64_t>(chunk))) {
+					delete chunk;
+					break;
+				}
+
+				in_flight++;
+				job->outstanding++;
+				job->queued_until += length;
+				if (job->queued_until == job->read.bytes.size()) {
+					active.push_back(std::move(job));
+					waiting.pop_front();
+				}
+			}
+
+			if (in_flight == 0) {
+				continue;
+			}
+
+			const int entered = _ring->enter(1);
+			if (entered < 0 && entered != -EINTR && entered != -EAGAIN && entered != -EBUSY) {
+				error_log()->error("FileReader: io_uring_enter failed: {}, falling back to blocking reads",
+								   std::strerror(-entered));
+				abandon_ring(waiting, active);
+				run_pool();
+				return;
+			}
+
+			io_uring_cqe completion{};
+			while (_ring->pop(completion)) {
+				in_flight--;
+				auto* chunk = reinterpret_cast<Chunk*>(completion.user_data);
+				auto* job = chunk->job;
+
+				if (completion.res == -EINTR || completion.res == -EAGAIN) {
+					// try the same chunk again
+					if (_ring->queue_readv(job->fd, &chunk->iov, chunk->offset, completion.user_data)) {
+						in_flight++;
+						continue;
+					}
+				}
+
+				if (completion.res < 0) {
+					if (!job->failure.has_value()) {
+						job->failure = FileRead::failed(ReadError::read_failed, -completion.res);
+					}
+				} else if (completion.res == 0) {
+					// the file shrank under us, keep what was read up to here
+					job->end = std::min(job->end, chunk->offset);
+				} else if (static_cast<std::size_t>(completion.res) < chunk->iov.iov_len) {
+					// short read, ask for the rest
+					const auto got = static_cast<std::size_t>(completion.res);
+					chunk->offset += got;
+					chunk->iov.iov_base = static_cast<char*>(chunk->iov.iov_base) + got;
+					chunk->iov.iov_len -= got;
+					if (_ring->queue_readv(job->fd, &chunk->iov, chunk->offset, completion.user_data)) {
+						in_flight++;
+						continue;
+					}
+					if (!job->failure.has_value()) {
+						job->failure = FileRead::failed(ReadError::read_failed, EAGAIN);
+					}
+				}
+
+				delete chunk;
+				job->outstanding--;
+
+				if (job->outstanding == 0) {
+					auto done = std::find_if(active.begin(), active.end(), [job](const auto& candidate) {
+						return candidate.get() == job;
+					});
+					if (done != active.end()) {
+						finish(*done);
+						active.erase(done);
+					}
+				}
+			}
+		}
+	}
+
+   public:
+	explicit FileReader(unsigned queue_depth = 64, std::size_t fallback_threads = 4, bool use_io_uring = true) {
+		if (use_io_uring) {
+			_ring = std::make_unique<IoUring>(queue_depth);
+			if (_ring->ok()) {
+				_threads.emplace_back(&FileReader::run_ring, this);
+				return;
+			}
+			console_log()->info("FileReader: io_uring unavailable, using {} reader threads", fallback_threads);
+			_ring.reset();
+		}
+
+		for (std::size_t i = 0; i < std::max<std::size_t>(fallback_threads, 1); i++) {
+			_threads.emplace_back(&FileReader::run_pool, this);
+		}
+	}
+
+	FileReader(const FileReader&) = delete;
+	FileReader& operator=(const FileReader&) = delete;
+
+	~FileReader() {
+		{
+			std::lock_guard lock{_mutex};
+			_stopping = true;
+		}
+		_wake.notify_all();
+		for (auto& thread : _threads) {
+			thread.join();
+		}
+	}
+
+	bool uses_io_uring() const {
+		return _ring != nullptr && !_ring_failed;
+	}
+
+	std::future<FileRead> read(const std::string& filepath) {
+		Request request{filepath};
+		auto future = request.promise.get_future();
+		{
+			std::lock_guard lock{_mutex};
+			_requests.push_back(std::move(request));
+		}
+		_wake.notify_one();
+		return future;
+	}
+
+	// asks the kernel to start reading a file we will want soon, without waiting for it
+	void prefetch(const std::string& filepath) {
+		{
+			std::lock_guard lock{_mutex};
+			_requests.push_back(Request{filepath, true});
+		}
+		_wake.notify_one();
+	}
+};
+
+TEST_CASE("FileReader") {
+	const auto root = std::filesystem::temp_directory_path() / fmt::format("isbn_scanner_reader_{}", getpid());
+	std::filesystem::create_directories(root);
+
+	// big enough to be split into several chunks
+	std::string big(3 * (1 << 20) + 17, 'x');
+	big[12345] = 'y';
+	{
+		std::ofstream fh(root / "big", std::ios::binary);
+		fh << big;
+	}
+	{
+		std::ofstream fh(root / "small", std::ios::binary);
+		fh << "small";
+	}
+	{
+		std::ofstream fh(root / "empty", std::ios::binary);
+	}
+
+	for (bool use_io_uring : {true, false}) {
+		FileReader reader{4, 2, use_io_uring};
+
+		reader.prefetch((root / "big").string());
+		auto bigRead = reader.read((root / "big").string());
+		auto smallRead = reader.read((root / "small").string());
+		auto emptyRead = reader.read((root / "empty").string());
+		auto missingRead = reader.read((root / "missing").string());
+
+		auto bigResult = bigRead.get();
+		CHECK(static_cast<bool>(bigResult));
+		CHECK(bigResult.bytes == big);
+		CHECK(smallRead.get().bytes == "small");
+
+		auto emptyResult = emptyRead.get();
+		CHECK(static_cast<bool>(emptyResult));
+		CHECK(emptyResult.bytes.empty());
+
+		auto missingResult = missingRead.get();
+		CHECK(missingResult.error == ReadError::open_failed);
+	}
+
+	CHECK(read_file_head((root / "big").string(), 4).bytes == "xxxx");
+	CHECK(read_file_head((root / "small").string(), 4096).bytes == "small");
+
+	std::filesystem::remove_all(root);
+}
@@ -0,0 +1,507 @@
+/*
+Copyright 2023 larkwiot
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+		http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include <algorithm>
+#include <bit>
+#include <cctype>
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <istream>
+#include <limits>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <nlohmann/json.hpp>
+#include <spdlog/spdlog.h>
+
+#include "book.hpp"
+#include "metadata_provider.hpp"
+#include "log.hpp"
+#include "test.hpp"
+#include "util.hpp"
+
+#pragma once
+
+using json = nlohmann::json;
+
+// On-disk layout of an ISBN index, all integers in host byte order:
+//
+//   IsbnIndexHeader
+//   IsbnIndexEntry[count]   in Eytzinger (BFS) order of their ISBNs so lookups walk one cache line per tree level
+//   string table            NUL terminated strings, referenced by byte offset from the start of the table
+//
+// Entries are keyed by the value is_valid_isbn() produces, so the scanner's ISBNs can be looked up as they are.
+
+static constexpr char isbn_index_magic[8] = {'I', 'S', 'B', 'N', 'I', 'D', 'X', '1'};
+
+struct IsbnIndexHeader {
+	char magic[8];
+	std::uint32_t version;
+	std::uint32_t entry_size;
+	std::uint64_t count;
+	std::uint64_t strings_offset;
+	std::uint64_t strings_size;
+};
+
+struct IsbnIndexEntry {
+	std::uint64_t isbn;
+	std::uint64_t author;
+	std::uint64_t title;
+	std::int32_t low_year;
+	std::int32_t high_year;
+};
+
+static_assert(sizeof(IsbnIndexEntry) == 32);
+
+class IsbnIndexWriter {
+	std::vector<IsbnIndexEntry> _entries{};
+	std::string _strings{};
+	std::unordered_map<std::string, std::uint64_t> _authors{};
+
+	std::uint64_t add_string(const std::string& value) {
+		const auto offset = _strings.size();
+		_strings.append(value);
+		_strings.push_back('\0');
+		return offset;
+	}
+
+   public:
+	// authors repeat a lot across editions so they are stored once, titles are stored as they come
+	void add(ISBN isbn, const std::string& author, const std::string& title, long lowYear, long highYear) {
+		auto [found, inserted] = _authors.try_emplace(author, 0);
+		if (inserted) {
+			found->second = add_string(author);
+		}
+
+		_entries.push_back({isbn, found->second, add_string(title), static_cast<std::int32_t>(lowYear),
+							static_cast<std::int32_t>(highYear)});
+	}
+
+	std::size_t size() const {
+		return _entries.size();
+	}
+
+	bool write(const std::string& filepath) {
+		std::stable_sort(_entries.begin(), _entries.end(), [](const IsbnIndexEntry& a, const IsbnIndexEntry& b) {
+			return a.isbn < b.isbn;
+		});
+
+		// the first edition seen for an ISBN wins
+		_entries.erase(std::unique(_entries.begin(), _entries.end(),
+								   [](const IsbnIndexEntry& a, const IsbnIndexEntry& b) {
+									   return a.isbn == b.isbn;
+								   }),
+					   _entries.end());
+
+		// in-order walk of the implicit tree (children of k are 2k and 2k+1) hands out the sorted entries
+		std::vector<IsbnIndexEntry> eytzinger(_entries.size());
+		std::size_t next = 0;
+		std::vector<std::size_t> stack{};
+		std::size_t k = 1;
+		while (k <= eytzinger.size() || !stack.empty()) {
+			while (k <= eytzinger.size()) {
+				stack.push_back(k);
+				k = 2 * k;
+			}
+			k = stack.back();
+			stack.pop_back();
+			eytzinger[k - 1] = _entries[next++];
+			k = 2 * k + 1;
+		}
+
+		IsbnIndexHeader header{};
+		std::memcpy(header.magic, isbn_index_magic, sizeof(header.magic));
+		header.version = 1;
+		header.entry_size = sizeof(IsbnIndexEntry);
+		header.count = eytzinger.size();
+		header.strings_offset = sizeof(IsbnIndexHeader) + eytzinger.size() * sizeof(IsbnIndexEntry);
+		header.strings_size = _strings.size();
+
+		std::ofstream fh(filepath, std::ios::binary | std::ios::trunc);
+		fh.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		fh.write(reinterpret_cast<const char*>(eytzinger.data()),
+				 static_cast<long>(eytzinger.size() * sizeof(IsbnIndexEntry)));
+		fh.write(_strings.data(), static_cast<long>(_strings.size()));
+		fh.close();
+
+		return static_cast<bool>(fh);
+	}
+};
+
+// Read-only, memory-mapped view of an index written by IsbnIndexWriter
+class IsbnIndex {
+	void* _mapping = MAP_FAILED;
+	std::size_t _mapping_size{};
+	const IsbnIndexEntry* _entries = nullptr;
+	std::uint64_t _count{};
+	const char* _strings = nullptr;
+	std::uint64_t _strings_size{};
+
+	std::string string_at(std::uint64_t offset) const {
+		if (offset >= _strings_size) {
+			return "";
+		}
+		return std::string{_strings + offset, strnlen(_strings + offset, _strings_size - offset)};
+	}
+
+   public:
+	explicit IsbnIndex(const std::string& filepath) {
+		const int fd = open(filepath.c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd < 0) {
+			error_log()->error("IsbnIndex: could not open {}", filepath);
+			return;
+		}
+
+		struct stat info {};
+		if (fstat(fd, &info) != 0 || static_cast<std::size_t>(info.st_size) < sizeof(IsbnIndexHeader)) {
+			error_log()->error("IsbnIndex: {} is too small to be an ISBN index", filepath);
+			close(fd);
+			return;
+		}
+
+		_mapping_size = static_cast<std::size_t>(info.st_size);
+		_mapping = mmap(nullptr, _mapping_size, PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+
+		if (_mapping == MAP_FAILED) {
+			error_log()->error("IsbnIndex: could not map {}", filepath);
+			return;
+		}
+
+		const auto* base = static_cast<const char*>(_mapping);
+		IsbnIndexHeader header{};
+		std::memcpy(&header, base, sizeof(header));
+
+		if (std::memcmp(header.magic, isbn_index_magic, sizeof(header.magic)) != 0 || header.version != 1 ||
+			header.entry_size != sizeof(IsbnIndexEntry) ||
+			header.strings_offset != sizeof(IsbnIndexHeader) + header.count * sizeof(IsbnIndexEntry) ||
+			header.strings_offset + header.strings_size > _mapping_size) {
+			error_log()->error("IsbnIndex: {} is not a valid ISBN index", filepath);
+			munmap(_mapping, _mapping_size);
+			_mapping = MAP_FAILED;
+			return;
+		}
+
+		_entries = reinterpret_cast<const IsbnIndexEntry*>(base + sizeof(IsbnIndexHeader));
+		_count = header.count;
+		_strings = base + header.strings_offset;
+		_strings_size = header.strings_size;
+
+		// the top of the tree is touched by every lookup, the rest is effectively random
+		madvise(_mapping, _mapping_size, MADV_RANDOM);
+	}
+
+	IsbnIndex(const IsbnIndex&) = delete;
+	IsbnIndex& operator=(const IsbnIndex&) = delete;
+
+	~IsbnIndex() {
+		if (_mapping != MAP_FAILED) {
+			munmap(_mapping, _mapping_size);
+		}
+	}
+
+	bool is_open() const {
+		return _entries != nullptr;
+	}
+
+	std::uint64_t size() const {
+		return _count;
+	}
+
+	std::optional<Book> find(ISBN isbn) const {
+		if (!is_open()) {
+			return std::nullopt;
+		}
+
+		// branchless descent, then drop the trailing right turns (and the one left turn before them) to land on the
+		// lower bound
+		std::uint64_t k = 1;
+		while (k <= _count) {
+			__builtin_prefetch(_entries + std::min(16 * k, _count) - 1);
+			k = 2 * k + (_entries[k - 1].isbn < isbn ? 1 : 0);
+		}
+		k >>= std::countr_one(k) + 1;
+
+		if (k == 0 || _entries[k - 1].isbn != isbn) {
+			return std::nullopt;
+		}
+
+		const auto& entry = _entries[k - 1];
+		return Book{isbn, string_at(entry.author), string_at(entry.title), entry.low_year, entry.high_year, ""};
+	}
+};
+
+class OfflineProvider : public MetadataProvider {
+	const IsbnIndex& _index;
+
+   public:
+	explicit OfflineProvider(const IsbnIndex& index) : _index(index){};
+
+	std::string name() const override {
+		return "offline index";
+	}
+
+	std::unordered_set<Book> lookup(ISBN isbn, CancellationToken&) override {
+		auto book = _index.find(isbn);
+		if (!book) {
+			return {};
+		}
+		return {book.value()};
+	}
+};
+
+long first_year(const std::string& date) {
+	for (std::size_t i = 0; i + 4 <= date.size(); i++) {
+		if (std::all_of(date.begin() + static_cast<long>(i), date.begin() + static_cast<long>(i) + 4, [](char c) {
+				return std::isdigit(static_cast<unsigned char>(c)) != 0;
+			})) {
+			return std::stol(date.substr(i, 4));
+		}
+	}
+	return 0;
+}
+
+TEST_CASE("first_year()") {
+	CHECK(first_year("March 3, 1999") == 1999);
+	CHECK(first_year("2004-05") == 2004);
+	CHECK(first_year("n.d.") == 0);
+	CHECK(first_year("\xC3\xA9t\xC3\xA9 1987") == 1987);
+}
+
+// Author names from an Open Library authors dump, for the editions dump only refers to its authors by key. Keys
+// ("/authors/OL123A") are kept by their number and names packed in one buffer, the dump has over ten million authors.
+class OpenLibraryAuthors {
+	struct Entry {
+		std::uint32_t id;
+		std::uint32_t offset;
+		std::uint32_t length;
+	};
+
+	std::vector<Entry> _entries{};
+	std::string _names{};
+
+	static std::optional<std::uint32_t> parse_key(std::string_view key) {
+		static constexpr std::string_view prefix = "/authors/OL";
+		if (!key.starts_with(prefix) || !key.ends_with('A')) {
+			return std::nullopt;
+		}
+		key = key.substr(prefix.size(), key.size() - prefix.size() - 1);
+
+		std::uint32_t id = 0;
+		const auto [end, error] = std::from_chars(key.data(), key.data() + key.size(), id);
+		if (error != std::errc{} || end != key.data() + key.size()) {
+			return std::nullopt;
+		}
+		return id;
+	}
+
+   public:
+	// reads the dump in the same formats as import_open_library(), returns the number of authors with a name
+	std::size_t load(std::istream& in) {
+		std::string line;
+		while (std::getline(in, line)) {
+			const auto tab = line.rfind('\t');
+			const auto record = json::parse(tab == std::string::npos ? line : line.substr(tab + 1), nullptr, false);
+			if (record.is_discarded() || !record.is_object() || !record.contains("key") || !record["key"].is_string()) {
+				continue;
+			}
+
+			const auto id = parse_key(record["key"].get<std::string>());
+			const auto name = record.value("name", std::string{});
+			// offsets into _names are 32 bit
+			if (!id.has_value() || name.empty() ||
+				_names.size() + name.size() > std::numeric_limits<std::uint32_t>::max()) {
+				continue;
+			}
+
+			_entries.push_back(Entry{id.value(), static_cast<std::uint32_t>(_names.size()),
+									 static_cast<std::uint32_t>(name.size())});
+			_names += name;
+		}
+
+		std::sort(_entries.begin(), _entries.end(), [](const Entry& a, const Entry& b) {
+			return a.id < b.id;
+		});
+		return _entries.size();
+	}
+
+	std::optional<std::string_view> find(std::string_view key) const {
+		const auto id = parse_key(key);
+		if (!id.has_value()) {
+			return std::nullopt;
+		}
+
+		const auto entry = std::lower_bound(_entries.begin(), _entries.end(), id.value(), [](const Entry& a, auto b) {
+			return a.id < b;
+		});
+		if (entry == _entries.end() || entry->id != id.value()) {
+			return std::nullopt;
+		}
+		return std::string_view{_names}.substr(entry->offset, entry->length);
+	}
+};
+
+// Reads an Open Library editions dump, either the raw tab separated dump (JSON in the last column) or plain JSON
+// lines, and adds every valid ISBN 10 and 13 it finds. Returns the number of editions that had at least one.
+// Most edition records only name their authors as keys into the authors dump, so without authors only the few with a
+// by_statement get an author.
+std::size_t import_open_library(std::istream& in,
+								IsbnIndexWriter& writer,
+								const OpenLibraryAuthors* authors = nullptr) {
+	std::size_t editions = 0;
+	std::string line;
+
+	while (std::getline(in, line)) {
+		const auto tab = line.rfind('\t');
+		const auto record = json::parse(tab == std::string::npos ? line : line.substr(tab + 1), nullptr, false);
+		if (record.is_discarded() || !record.is_object()) {
+			continue;
+		}
+
+		auto title = record.value("title", std::string{});
+		const auto subtitle = record.value("subtitle", std::string{});
+		if (!subtitle.empty()) {
+			title += ": " + subtitle;
+		}
+		std::string author{};
+		if (authors != nullptr && record.contains("authors") && record["authors"].is_array()) {
+			for (const auto& reference : record["authors"]) {
+				if (!reference.is_object() || !reference.contains("key") || !reference["key"].is_string()) {
+					continue;
+				}
+				if (const auto name = authors->find(reference["key"].get<std::string>())) {
+					author += fmt::format("{}{}", author.empty() ? "" : ", ", name.value());
+				}
+			}
+		}
+		if (author.empty()) {
+			author = record.value("by_statement", std::string{});
+		}
+		const auto year = first_year(record.value("publish_date", std::string{}));
+
+		bool added = false;
+		for (const auto* key : {"isbn_13", "isbn_10"}) {
+			if (!record.contains(key) || !record[key].is_array()) {
+				continue;
+			}
+
+			for (const auto& raw : record[key]) {
+				if (!raw.is_string()) {
+					continue;
+				}
+
+				const auto result = is_valid_isbn(raw.get<std::string>());
+				if (get<0>(result)) {
+					writer.add(get<1>(result), author, title, year, year);
+					added = true;
+				}
+			}
+		}
+
+		editions += added ? 1 : 0;
+	}
+
+	return editions;
+}
+
+TEST_CASE("IsbnIndex") {
+	const auto path = std::filesystem::temp_directory_path() / fmt::format("isbn_scanner_index_{}.bin", getpid());
+
+	std::istringstream authors_dump{
+		"/type/author\t/authors/OL1A\t1\t2010-01-01T00:00:00\t"
+		R"({"key": "/authors/OL1A", "name": "Tarik Soulami"})"
+		"\n"
+		R"({"key": "/authors/OL22A", "name": "Second Author"})"
+		"\n"
+		R"({"key": "/authors/OL3A"})"
+		"\n"
+		R"({"key": "/works/OL4W", "name": "not an author"})"
+		"\n"};
+	OpenLibraryAuthors authors{};
+	CHECK(authors.load(authors_dump) == 2);
+	CHECK(authors.find("/authors/OL22A") == "Second Author");
+	CHECK(!authors.find("/authors/OL3A").has_value());
+	CHECK(!authors.find("/authors/OL1").has_value());
+
+	std::istringstream dump{
+		"/type/edition\t/books/OL1M\t3\t2010-01-01T00:00:00\t"
+		R"({"title": "Inside Windows Debugging", "authors": [{"key": "/authors/OL1A"}], "publish_date": "2012",)"
+		R"( "isbn_13": ["9780735662780"], "isbn_10": ["0735662789"]})"
+		"\n"
+		R"({"title": "Duplicate", "isbn_13": ["9780735662780"]})"
+		"\n"
+		R"({"title": "Invalid", "isbn_13": ["9780735662781"]})"
+		"\n"
+		R"({"title": "Two authors", "authors": [{"key": "/authors/OL1A"}, {"key": "/authors/OL22A"}],)"
+		R"( "isbn_13": ["9780672328978"]})"
+		"\n"
+		R"({"title": "Unknown author", "authors": [{"key": "/authors/OL9A"}], "by_statement": "by Someone",)"
+		R"( "isbn_13": ["9781447123309"]})"
+		"\n"
+		"not json at all\n"};
+
+	IsbnIndexWriter writer{};
+	CHECK(import_open_library(dump, writer, &authors) == 4);
+
+	// enough filler to give the tree a few levels
+	for (ISBN isbn = 1000; isbn < 1100; isbn += 3) {
+		writer.add(isbn, "filler", fmt::format("title {}", isbn), 0, 0);
+	}
+	REQUIRE(writer.write(path.string()));
+
+	{
+		IsbnIndex index{path.string()};
+		REQUIRE(index.is_open());
+		CHECK(index.size() == 38);
+
+		auto book = index.find(9780735662780ul);
+		REQUIRE(book.has_value());
+		CHECK(book->title == "Inside Windows Debugging");
+		CHECK(book->author == "Tarik Soulami");
+		CHECK(book->lowYear == 2012);
+		CHECK(index.find(735662789ul).has_value());
+		CHECK(index.find(9780672328978ul)->author == "Tarik Soulami, Second Author");
+		CHECK(index.find(9781447123309ul)->author == "by Someone");
+
+		CHECK(!index.find(9780735662781ul).has_value());
+		CHECK(!index.find(0).has_value());
+		CHECK(!index.find(999999999999999ul).has_value());
+
+		for (ISBN isbn = 1000; isbn < 1100; isbn++) {
+			CHECK(index.find(isbn).has_value() == (isbn % 3 == 1));
+		}
+
+		OfflineProvider provider{index};
+		CancellationToken cancellation{};
+		CHECK(provider.lookup(1003, cancellation).begin()->title == "title 1003");
+		CHECK(provider.lookup(1004, cancellation).empty());
+	}
+
+	std::filesystem::remove(path);
+}
@@ -0,0 +1,60 @@
+/*
+Copyright 2023 larkwiot
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+		http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include <chrono>
+#include <cstdlib>
+#include <memory>
+
+#include <spdlog/async.h>
+#include <spdlog/sinks/stdout_color_sinks.h>
+#include <spdlog/spdlog.h>
+
+#pragma once
+
+// Calls below SPDLOG_ACTIVE_LEVEL (set per build type in CMakeLists.txt) compile to nothing, arguments included, so
+// debug logging on the hot path costs nothing in release builds
+#define LOG_TRACE(...) SPDLOG_LOGGER_TRACE(console_log(), __VA_ARGS__)
+#define LOG_DEBUG(...) SPDLOG_LOGGER_DEBUG(console_log(), __VA_ARGS__)
+
+// messages waiting for the logging thread, past this the oldest are dropped instead of blocking workers
+static constexpr std::size_t log_queue_size = 8192;
+
+// Creates the "console" and "stderr" loggers. Asynchronous loggers only queue messages and leave formatting the
+// output and writing it to a background thread, so a slow terminal or log file never stalls a worker.
+void init_logging(bool asynchronous) {
+	if (asynchronous) {
+		spdlog::init_thread_pool(log_queue_size, 1);
+		spdlog::stdout_color_mt<spdlog::async_factory_nonblock>("console");
+		spdlog::stdout_color_mt<spdlog::async_factory_nonblock>("stderr");
+		// drains whatever is still queued
+		std::atexit(spdlog::shutdown);
+	} else {
+		spdlog::stdout_color_mt("console");
+		spdlog::stdout_color_mt("stderr");
+	}
+	spdlog::flush_every(std::chrono::seconds(5));
+}
+
+// spdlog::get() locks the registry on every call, these look each logger up once
+spdlog::logger* console_log() {
+	static const auto logger = spdlog::get("console");
+	return logger.get();
+}
+
+spdlog::logger* error_log() {
+	static const auto logger = spdlog::get("stderr");
+	return logger.get();
+}
@@ -19,20 +19,94 @@
 struct Host {
 	std::string host;
 	int port;
+	std::chrono::milliseconds connect_timeout{5000};
+	std::chrono::milliseconds read_timeout{300000};
+	RetryPolicy retry{};
 };
 
-struct Tika : public Host {};
+struct Tika : public Host {
+	// a second endpoint that requests running slower than hedge_percentile of recent ones, scaled to their size, are
+	// duplicated to
+	std::optional<Host> hedge{};
+	double hedge_percentile = 95.0;
+	std::shared_ptr<LatencyTracker> latencies = std::make_shared<LatencyTracker>();
+};
+
+struct ScanOptions {
+	size_t max_chars;
+	// metadata lookups allowed per file, every one of them may be a rate limited request
+	size_t max_lookups;
+	// title_match_score() at which a looked up work is taken to be the file and the remaining ISBNs are skipped
+	double confident_title_match;
+};
+
+// How far a file got. Counted for the end-of-run report, and what decides whether a file is quarantined.
+enum class FileOutcome {
+	matched,
+	// not a type that is sent to Tika
+	unsupported,
+	read_failed,
+	// Tika could not be connected to at all, which says nothing about the file
+	tika_unreachable,
+	// Tika answered with an error or dropped the connection while working on the file
+	extraction_failed,
+	no_text,
+	no_isbns,
+	not_found,
+	// ran out of its time budget
+	timed_out,
+	// the scan is shutting down
+	cancelled,
+};
+
+struct FileText {
+	std::string text{};
+	// why there is no text, if there is none
+	std::optional<FileOutcome> failure{};
+	// ISBNs the file declares in its own metadata, in which case its text was never extracted
+	std::vector<IsbnCandidate> embedded{};
+};
 
 struct WorldCat : public Host {
 	std::string path;
 };
 
+void configure_client(httplib::Client& client, const Host& host) {
+	client.set_keep_alive(true);
+	client.set_connection_timeout(host.connect_timeout);
+	client.set_read_timeout(host.read_timeout);
+	client.set_write_timeout(host.read_timeout);
+}
+
+// one keep-alive connection per host per worker thread, so consecutive files reuse warm connections. A different role
+// gets its own connection to the same host, e.g. a hedge pointed at the primary must not share its client.
+httplib::Client& get_client(const Host& host, std::string_view role = "") {
+	thread_local std::map<std::string, std::unique_ptr<httplib::Client>> clients{};
+
+	auto& client = clients[fmt::format("{}:{}:{}", role, host.host, host.port)];
+	if (!client) {
+		client = std::make_unique<httplib::Client>(host.host, host.port);
+		configure_client(*client, host);
+	}
+
+	return *client;
+}
+
+// connection failures, timeouts and overload responses are worth another try, anything else will fail the same way
+bool is_transient(const httplib::Result& resp) {
+	if (!resp) {
+		return resp.error() != httplib::Error::Canceled;
+	}
+	return resp->status == 408 || resp->status == 429 || resp->status == 502 || resp->status == 503 ||
+		   resp->status == 504;
+}
+
 std::unordered_set<Book> parse_worldcat_data(const std::string& worldcat_xml) {
 	pugi::xml_document doc;
 	pugi::xml_parse_result result = doc.load_string(worldcat_xml.c_str());
 
 	if (!result) {
-		spdlog::get("console")->warn("parse_worldcat_data(): could not parse XML:\n{}", worldcat_xml);
+		console_log()->warn("parse_worldcat_data(): could not parse XML:\n{}", worldcat_xml);
 		return {};
 	}
 
@@ -72,7 +146,7 @@ std::unordered_set<Book> parse_worldcat_data(const std::string& worldcat_xml) {
 	}
 
 	if (classify.child("works").empty()) {
-		spdlog::get("console")->debug("parse_worldcat_data(): worldcat had no result");
+		LOG_DEBUG("parse_worldcat_data(): worldcat had no result");
 		return {};
 	}
 
@@ -110,161 +184,407 @@ std::unordered_set<Book> parse_worldcat_data(const std::string& worldcat_xml) {
 	return books;
 }
 
-std::unordered_set<Book> get_by_isbn(RateLimited<WorldCat, std::string>& rateWorldCat, ISBN isbn) {
-	auto requestWorldCat = [&isbn](WorldCat& worldCat) {
-		auto client = httplib::Client(worldCat.host, worldCat.port);
+std::unordered_set<Book> get_by_isbn(RateLimited<WorldCat, std::string>& rateWorldCat,
+									 const RetryPolicy& retry,
+									 CancellationToken& cancellation,
+									 ISBN isbn) {
+	bool transient = false;
+
+	auto requestWorldCat = [&isbn, &transient, &cancellation](WorldCat& worldCat) {
+		transient = false;
+		if (cancellation.cancelled()) {
+			return std::string{""};
+		}
+
+		auto& client = get_client(worldCat);
+		const auto stopper = cancellation.on_cancel([&client]() {
+			client.stop();
+		});
 
 		auto resp = client.Get(fmt::format("{}?isbn={}", worldCat.path, isbn));
+		transient = is_transient(resp);
 
 		if (!resp) {
-			spdlog::get("console")->warn("get_by_isbn(): could not reach worldcat, request failed: {}",
-										 to_string(resp.error()));
+			console_log()->warn("get_by_isbn(): could not reach worldcat, request failed: {}", to_string(resp.error()));
 			return std::string{""};
 		}
 
 		if (resp->status != 200) {
-			spdlog::get("console")->warn("get_by_isbn(): could not request metadata for ISBN: {} status: {} path: {}",
-										 isbn, resp->status, resp->location);
+			console_log()->warn("get_by_isbn(): could not request metadata for ISBN: {} status: {} path: {}",
+								isbn, resp->status, resp->location);
 			return std::string{""};
 		}
 
 		return resp->body;
 	};
 
-	const auto body = rateWorldCat.use(requestWorldCat);
+	// every attempt waits its turn at the rate limiter, the backoff sleeps happen outside of it
+	const std::function<std::string()> attempt = [&rateWorldCat, &requestWorldCat, &cancellation]() {
+		return rateWorldCat.use(requestWorldCat, &cancellation);
+	};
+	const std::function<bool(const std::string&)> retryable = [&transient](const std::string&) {
+		return transient;
+	};
+
+	const auto body = with_retries(retry, attempt, retryable, &cancellation);
 
 	return parse_worldcat_data(body);
 }
 
-std::string get_file_text(const Tika& tika, const std::string& fn, const json& filetypes) {
-	auto ext = get_file_extension(fn);
-	if (ext.empty()) {
-		spdlog::get("console")->warn("skipping {} because it does not have a file extension", fn);
-		return "";
-	}
+class WorldCatProvider : public MetadataProvider {
+	RateLimited<WorldCat, std::string>& _worldCat;
+	RetryPolicy _retry;
 
-	if (!filetypes.contains(ext)) {
-		spdlog::get("console")->warn("skipping {} because no mime type is known for the extension {}", fn, ext);
-		return "";
+   public:
+	explicit WorldCatProvider(RateLimited<WorldCat, std::string>& worldCat, const RetryPolicy& retry)
+		: _worldCat(worldCat), _retry(retry){};
+
+	std::string name() const override {
+		return "WorldCat";
 	}
 
-	const auto mime_type = filetypes[ext].get<std::string>();
+	std::unordered_set<Book> lookup(ISBN isbn, CancellationToken& cancellation) override {
+		return get_by_isbn(_worldCat, _retry, cancellation, isbn);
+	}
+};
 
-	auto client = httplib::Client(tika.host, tika.port);
+// Uploads content as a single file multipart form, streaming it from the caller's buffer instead of copying it into a
+// request body first. The upload is abandoned if cancellation is cancelled while it is being sent.
+httplib::Result post_multipart_file(httplib::Client& client,
+									const std::string& path,
+									const std::string& filename,
+									const std::string& mime_type,
+									const std::string& content,
+									const CancellationToken& cancellation) {
+	thread_local std::mt19937_64 random{std::random_device{}()};
+	const auto boundary = fmt::format("----isbn-scanner-{:016x}{:016x}", random(), random());
+
+	const auto head = fmt::format(
+		"--{}\r\nContent-Disposition: form-data; name=\"upload\"; filename=\"{}\"\r\nContent-Type: {}\r\n\r\n", boundary,
+		filename, mime_type);
+	const auto tail = fmt::format("\r\n--{}--\r\n", boundary);
+
+	const std::array<std::string_view, 3> parts{head, content, tail};
+
+	auto provider = [&parts, &cancellation](size_t offset, size_t length, httplib::DataSink& sink) {
+		if (cancellation.cancelled()) {
+			return false;
+		}
+		for (auto part : parts) {
+			if (offset < part.size()) {
+				return sink.write(part.data() + offset, std::min(length, part.size() - offset));
+			}
+			offset -= part.size();
+		}
+		return true;
+	};
 
-	const auto content = read_file_bytes_as_string(fn);
+	return client.Post(path, httplib::Headers{}, head.size() + content.size() + tail.size(), provider,
+					   fmt::format("multipart/form-data; boundary={}", boundary));
+}
 
-	auto form = httplib::MultipartFormDataItems{httplib::MultipartFormData{"upload", content, fn, mime_type}};
+// Asks Tika which version it is, cached texts are only valid for the extractor that produced them
+std::optional<std::string> get_tika_version(const Tika& tika) {
+	auto resp = get_client(tika).Get("/version");
+	if (!resp || resp->status != 200) {
+		return std::nullopt;
+	}
 
-	auto resp = client.Post("/tika/form", form);
+	auto version = resp->body;
+	version.erase(version.find_last_not_of(" \r\n") + 1);
+	return version;
+}
 
-	if (!resp) {
-		spdlog::get("console")->warn("get_file_text(): could not reach tika, request failed: {}",
-									 httplib::to_string(resp.error()));
-		return "";
+FileText get_file_text(const Tika& tika,
+					   const std::string& fn,
+					   const json& filetypes,
+					   FileReader& reader,
+					   Archives& archives,
+					   TextCache* cache,
+					   CancellationToken& cancellation,
+					   bool use_embedded = true) {
+	// files inside archives are read straight out of them, never extracted to disk
+	const bool member = is_archive_member_path(fn);
+
+	// a few KB decide whether the file is worth reading in full and uploading at all
+	const auto head = member ? archives.read(fn, sniff_length) : read_file_head(fn, sniff_length);
+	if (!head) {
+		error_log()->error("get_file_text(): could not read {}: {}", fn, head.describe());
+		return {"", FileOutcome::read_failed};
 	}
 
-	if (resp->status != 200) {
-		spdlog::get("console")->warn("get_file_text(): could not get text for file, tika failed to process it: {}", fn);
-		return "";
+	const auto kind = sniff_file_kind(head.bytes);
+	const auto sniffed_mime = choose_mime_type(kind, get_file_extension(fn), filetypes);
+	if (!sniffed_mime.has_value()) {
+		console_log()->info("skipping {} because its contents ({}) are not a supported type", fn,
+							magic_enum::enum_name(kind));
+		return {"", FileOutcome::unsupported};
+	}
+	const auto& mime_type = sniffed_mime.value();
+
+	// ISBNs declared in the file's metadata are taken over anything in its text, and finding one spares extracting the
+	// text as well as, unless it is in an archive and so can only be read front to back, reading the whole file
+	FileRead read{};
+	std::vector<IsbnCandidate> embedded{};
+	if (member) {
+		read = archives.read(fn);
+		if (read && use_embedded) {
+			embedded = find_embedded_isbns(kind, read_at_buffer(read.bytes), read.bytes.size());
+		}
+	} else {
+		if (use_embedded) {
+			embedded = find_embedded_isbns_in_file(fn, kind, head.bytes, cancellation);
+		}
+		if (cancellation.cancelled()) {
+			return {"", FileOutcome::cancelled};
+		}
+		if (embedded.empty()) {
+			// a read stuck on a slow or failing disk cannot be interrupted, but it need not hold the worker past its
+			// budget
+			auto pending = reader.read(fn);
+			while (pending.wait_for(std::chrono::milliseconds(100)) != std::future_status::ready) {
+				if (cancellation.cancelled()) {
+					return {"", FileOutcome::cancelled};
+				}
+			}
+			read = pending.get();
+		}
 	}
 
-	return resp->body;
-}
+	if (!embedded.empty()) {
+		LOG_DEBUG("get_file_text(): {} declares {} ISBNs in its metadata", fn, embedded.size());
+		return {"", std::nullopt, std::move(embedded)};
+	}
 
-void process_file(const std::string& filepath,
-				  size_t max_chars,
-				  Lockable<json>& output,
-				  const json& filetypes,
-				  const Tika& tika,
-				  RateLimited<WorldCat, std::string>& worldCat) {
-	//	spdlog::get("console")->info("process_file(): working on {}", filepath);
-	const auto filetext = get_file_text(tika, filepath, filetypes);
-	if (filetext.empty()) {
-		spdlog::get("console")->debug("process_file(): {} got no text", filepath);
-		return;
+	if (!read) {
+		error_log()->error("get_file_text(): could not read {}: {}", fn, read.describe());
+		return {"", FileOutcome::read_failed};
 	}
-	spdlog::get("console")->debug("process_file(): {} got file text", filepath);
 
-	const auto found_isbns = find_isbns(filetext.substr(0, max_chars));
-	if (found_isbns.empty()) {
-		spdlog::get("console")->debug("process_file(): {} no found_isbns", filepath);
-		return;
+	std::string cache_key{};
+	if (cache != nullptr) {
+		cache_key = cache->key(read.bytes);
+		if (auto cached = cache->get(cache_key)) {
+			LOG_DEBUG("get_file_text(): {} found in the text cache", fn);
+			return {std::move(cached.value())};
+		}
 	}
 
-	std::unordered_set<ISBN> isbns{};
-	for (const auto& isbn : found_isbns) {
-		const auto result = is_valid_isbn(isbn);
-		bool is_valid = get<0>(result);
-		ISBN cleaned_isbn = get<1>(result);
-		if (is_valid) {
-			isbns.insert(cleaned_isbn);
+	// both clients belong to this worker thread, the hedging thread only borrows the hedge one while hedged() runs
+	std::array<httplib::Client*, 2> clients{&get_client(tika),
+											tika.hedge ? &get_client(tika.hedge.value(), "hedge") : nullptr};
+
+	const auto stopper = cancellation.on_cancel([&clients]() {
+		for (auto* client : clients) {
+			if (client != nullptr) {
+				client->stop();
+			}
+		}
+	});
+
+	const std::function<bool(const httplib::Result&)> succeeded = [](const httplib::Result& resp) {
+		return resp && resp->status == 200;
+	};
+	const std::function<httplib::Result(size_t, CancellationToken&)> request = [&](size_t endpoint,
+																				   CancellationToken& aborted) {
+		// the file running out of time or the scan shutting down aborts whichever attempt this is too
+		const auto forward = cancellation.on_cancel([&aborted]() {
+			aborted.cancel();
+		});
+		if (aborted.cancelled()) {
+			return httplib::Result{nullptr, httplib::Error::Canceled};
+		}
+
+		const auto start = std::chrono::steady_clock::now();
+		auto resp = post_multipart_file(*clients[endpoint], "/tika/form", fn, mime_type, read.bytes, aborted);
+		if (succeeded(resp)) {
+			tika.latencies->record(std::chrono::steady_clock::now() - start, read.bytes.size());
 		}
+		return resp;
+	};
+	const std::function<void(size_t)> stop = [&clients](size_t endpoint) {
+		clients[endpoint]->stop();
+	};
+	const std::function<httplib::Result()> attempt = [&]() {
+		const auto delay =
+			tika.hedge ? tika.latencies->percentile(tika.hedge_percentile, read.bytes.size()) : std::nullopt;
+		return hedged(request, stop, succeeded, delay);
+	};
+
+	auto resp = with_retries(tika.retry, attempt, std::function<bool(const httplib::Result&)>{is_transient},
+							 &cancellation);
+
+	if (cancellation.cancelled()) {
+		return {"", FileOutcome::cancelled};
 	}
 
-	if (isbns.empty()) {
-		spdlog::get("console")->debug("process_file(): {} no valid ISBNs", filepath);
-		return;
+	if (!resp) {
+		console_log()->warn("get_file_text(): could not reach tika, request failed: {}",
+							httplib::to_string(resp.error()));
+		return {"", resp.error() == httplib::Error::Connection ? FileOutcome::tika_unreachable
+															   : FileOutcome::extraction_failed};
+	}
+
+	if (resp->status != 200) {
+		console_log()->warn("get_file_text(): could not get text for file, tika failed to process it: {}", fn);
+		return {"", FileOutcome::extraction_failed};
 	}
 
-	spdlog::get("console")->debug("process_file(): found {} valid ISBNs", isbns.size());
+	if (resp->body.empty()) {
+		return {"", FileOutcome::no_text};
+	}
+
+	if (cache != nullptr) {
+		cache->put(cache_key, resp->body);
+	}
 
+	return {std::move(resp->body)};
+}
+
+// Looks candidates up, most likely first, stopping as soon as one of them clearly is the book in hand. Nothing if
+// cancelled midway.
+std::optional<std::unordered_set<Book>> look_up_candidates(const std::string& filepath,
+														   const std::vector<IsbnCandidate>& candidates,
+														   const ScanOptions& options,
+														   MetadataProvider& metadata,
+														   CancellationToken& cancellation) {
+	const std::string filename = std::filesystem::path(filepath).filename().string();
 	std::unordered_set<Book> books{};
+	size_t lookups = 0;
+
+	for (const auto& candidate : candidates) {
+		if (lookups >= options.max_lookups) {
+			LOG_DEBUG("look_up_candidates(): {} reached {} lookups, skipping {} remaining ISBNs",
+					  filepath, lookups, candidates.size() - lookups);
+			break;
+		}
+		lookups++;
+
+		const ISBN isbn = candidate.isbn;
+		auto newBooks = metadata.lookup(isbn, cancellation);
 
-	for (ISBN isbn : isbns) {
-		auto newBooks = get_by_isbn(worldCat, isbn);
+		// a half looked up file is left out of the output so the next run does it again
+		if (cancellation.cancelled()) {
+			LOG_DEBUG("look_up_candidates(): {} cancelled during lookups", filepath);
+			return std::nullopt;
+		}
 
 		if (newBooks.empty()) {
-			spdlog::get("console")->debug("process_file(): WorldCat returned nothing for isbn: {}", isbn);
+			LOG_DEBUG("look_up_candidates(): {} returned nothing for isbn: {}", metadata.name(), isbn);
 			continue;
 		}
 
-		spdlog::get("console")->debug("process_file(): WorldCat found {} works for {}", newBooks.size(), isbn);
+		LOG_DEBUG("look_up_candidates(): {} found {} works for {}", metadata.name(), newBooks.size(), isbn);
 
+		bool confident = false;
 		for (auto newBook : newBooks) {
 			newBook.isbn = isbn;
 			newBook.filepath = filepath;
+			confident = confident || title_match_score(newBook.title, filename) >= options.confident_title_match;
 			books.insert(newBook);
 		}
+
+		if (confident) {
+			LOG_DEBUG("look_up_candidates(): {} confidently matched {} after {} lookups", filepath, isbn, lookups);
+			break;
+		}
 	}
 
-	if (books.empty()) {
-		spdlog::get("console")->debug("process_file(): none of the ISBNs were found on WorldCat");
-		return;
+	return books;
+}
+
+FileOutcome process_file(const std::string& filepath,
+						 const ScanOptions& options,
+						 Lockable<json>& output,
+						 const json& filetypes,
+						 const Tika& tika,
+						 FileReader& reader,
+						 Archives& archives,
+						 TextCache* cache,
+						 MetadataProvider& metadata,
+						 CancellationToken& cancellation) {
+	//	console_log()->info("process_file(): working on {}", filepath);
+	auto extracted = get_file_text(tika, filepath, filetypes, reader, archives, cache, cancellation);
+	if (extracted.failure.has_value()) {
+		LOG_DEBUG("process_file(): {} got no text", filepath);
+		return extracted.failure.value();
 	}
 
-	spdlog::get("console")->debug("process_file(): found {} total works", books.size());
+	std::unordered_set<Book> books{};
+	const auto declared = std::move(extracted.embedded);
+	if (!declared.empty()) {
+		LOG_DEBUG("process_file(): {} declares {} valid ISBNs", filepath, declared.size());
+		auto found = look_up_candidates(filepath, declared, options, metadata, cancellation);
+		if (!found.has_value()) {
+			return FileOutcome::cancelled;
+		}
+		books = std::move(found.value());
+
+		// metadata may declare another edition's ISBN or a made up one while the text names the book just fine
+		if (books.empty()) {
+			LOG_DEBUG("process_file(): none of the ISBNs {} declares were found, extracting its text", filepath);
+			extracted = get_file_text(tika, filepath, filetypes, reader, archives, cache, cancellation, false);
+			if (extracted.failure.has_value()) {
+				LOG_DEBUG("process_file(): {} got no text", filepath);
+				return extracted.failure.value();
+			}
+		}
+	}
 
-	Book bestMatch;
+	if (books.empty()) {
+		LOG_DEBUG("process_file(): {} got file text", filepath);
+
+		auto candidates = rank_isbn_candidates(std::string_view{extracted.text}.substr(0, options.max_chars));
+		// the declared ones were already looked up
+		std::erase_if(candidates, [&declared](const IsbnCandidate& candidate) {
+			return std::any_of(declared.begin(), declared.end(), [&candidate](const IsbnCandidate& tried) {
+				return tried.isbn == candidate.isbn;
+			});
+		});
+		if (candidates.empty()) {
+			LOG_DEBUG("process_file(): {} no valid ISBNs", filepath);
+			return declared.empty() ? FileOutcome::no_isbns : FileOutcome::not_found;
+		}
 
-	if (books.size() > 1) {
-		const std::string filename = std::filesystem::path(filepath).filename().string();
-		std::unordered_map<size_t, std::string> levDists{};
-		size_t lowestDist = 999999999999999;
+		LOG_DEBUG("process_file(): found {} valid ISBNs", candidates.size());
 
-		for (const auto& book : books) {
-			ASSERT(!book.title.empty());
-			size_t dist = levenshtein_distance(book.title, filename);
-			if (dist < lowestDist) {
-				bestMatch = book;
-			}
+		auto found = look_up_candidates(filepath, candidates, options, metadata, cancellation);
+		if (!found.has_value()) {
+			return FileOutcome::cancelled;
 		}
-	} else {
-		ASSERT(books.size() == 1);
-		bestMatch = *books.begin();
+		books = std::move(found.value());
+	}
+
+	if (books.empty()) {
+		LOG_DEBUG("process_file(): none of the ISBNs were found by {}", metadata.name());
+		return FileOutcome::not_found;
 	}
 
+	LOG_DEBUG("process_file(): found {} total works", books.size());
+
+	const std::string filename = std::filesystem::path(filepath).filename().string();
+	const Book& bestMatch = best_title_match(books, filename);
+
 	ASSERT(bestMatch.isbn != 0ul);
 
 	auto book_json = bestMatch.to_json();
 
-	spdlog::get("console")->debug("process_file(): adding {} to JSON output", filepath);
+	LOG_DEBUG("process_file(): adding {} to JSON output", filepath);
 
 	output.use([&book_json](json& out) {
 		out.push_back(book_json);
 	});
 
-	spdlog::get("console")->info("process_file(): successfully processed {}", filepath);
+	console_log()->info("process_file(): successfully processed {}", filepath);
+	return FileOutcome::matched;
+}
+
+void configure_host(toml::node_view<toml::node> table, Host& host) {
+	host.connect_timeout = std::chrono::milliseconds(table["connect_timeout_milliseconds"].value_or<long>(5000));
+	host.read_timeout = std::chrono::milliseconds(table["read_timeout_milliseconds"].value_or<long>(300000));
+	host.retry.attempts = static_cast<int>(table["retries"].value_or<long>(2)) + 1;
+	host.retry.base_delay = std::chrono::milliseconds(table["backoff_milliseconds"].value_or<long>(500));
+	host.retry.max_delay = std::chrono::milliseconds(table["max_backoff_milliseconds"].value_or<long>(10000));
 }
 
 void print_usage(const clipp::group& cli, const std::string& programName) {
@@ -283,13 +603,38 @@ std::string get_feature_string() {
 	return fmt::format("Features: {} build", build);
 }
 
-int signalReceived = -233;
+// what happened to the files of this run, and every file that is quarantined now
+void report_run(const std::map<FileOutcome, size_t>& outcomes, const Quarantine& quarantine) {
+	for (const auto& [outcome, count] : outcomes) {
+		console_log()->info("main(): {} files {}", count, magic_enum::enum_name(outcome));
+	}
+
+	const auto quarantined = quarantine.quarantined();
+	if (quarantined.empty()) {
+		return;
+	}
+
+	console_log()->warn("main(): {} files are quarantined and will be skipped unless --retry-quarantined is given:",
+						quarantined.size());
+	for (const auto& [filepath, entry] : quarantined) {
+		console_log()->warn("main():     {}: {} ({} failures)", filepath, entry.reason, entry.failures);
+	}
+}
+
+void write_output_json(const std::string& filepath, const json& out) {
+	if (out.empty()) {
+		return;
+	}
+
+	std::ofstream fh(filepath);
+	std::string str{out.dump(4)};
+	fh.write(str.data(), static_cast<long>(str.size()));
+	fh.close();
+}
 
 #ifdef ISBN_SCANNER_IMPLEMENT_MAIN
 int main(int argc, char* argv[]) {
-	auto console_log = spdlog::stdout_color_mt("console");
-	auto error_log = spdlog::stdout_color_mt("stderr");
-	spdlog::flush_every(std::chrono::seconds(5));
+	init_logging(true);
 
 	bool debug = false;
 	bool verbose = false;
@@ -298,16 +643,47 @@ int main(int argc, char* argv[]) {
 	bool version = false;
 	std::string filetypesJsonPath;
 	std::string configFilepath;
-
-	auto cli =
+	std::string shardSpec = "0/1";
+	bool watch = false;
+	bool retryQuarantined = false;
+	bool merge = false;
+	bool importIndex = false;
+	std::string dumpFilepath;
+	std::string authorsFilepath;
+	std::string indexFilepath;
+	std::vector<std::string> mergeInputs;
+
+	auto scanCli =
 		clipp::group((clipp::required("-i", "--input") & clipp::value("input directory", inDirectory)),
 					 (clipp::required("-o", "--output") & clipp::value("output JSON file", outputJsonFilepath)),
-					 clipp::option("-d", "--debug").set(debug).doc("enable debug logging"),
+					 clipp::option("-d", "--debug").set(debug).doc("enable debug logging (debug builds only)"),
 					 clipp::option("-v", "--verbose").set(verbose).doc("enable verbose logging"),
 					 clipp::option("--version").set(version).doc("print version and feature info"),
 					 (clipp::required("-f", "--filetypes") &
 					  clipp::value("file types (mime types) JSON database", filetypesJsonPath)),
-					 (clipp::required("-c", "--config") & clipp::value("configuration TOML filepath", configFilepath)));
+					 (clipp::required("-c", "--config") & clipp::value("configuration TOML filepath", configFilepath)),
+					 (clipp::option("--shard") & clipp::value("i/N", shardSpec))
+						 .doc("only scan files whose relative path hashes to shard i of N (0 <= i < N)"),
+					 clipp::option("-w", "--watch")
+						 .set(watch)
+						 .doc("keep running after the initial scan and process new or changed files as they land"),
+					 clipp::option("--retry-quarantined")
+						 .set(retryQuarantined)
+						 .doc("also scan files that earlier runs quarantined for running out of time or failing"));
+
+	auto mergeCli =
+		clipp::group(clipp::command("merge").set(merge).doc("combine shard output JSON files, deduplicated by filepath"),
+					 (clipp::required("-o", "--output") & clipp::value("merged output JSON file", outputJsonFilepath)),
+					 clipp::values("shard output JSON files", mergeInputs));
+
+	auto importCli = clipp::group(
+		clipp::command("import").set(importIndex).doc("build an offline ISBN index from an Open Library editions dump"),
+		(clipp::required("-i", "--input") & clipp::value("editions dump", dumpFilepath)),
+		(clipp::option("-a", "--authors") & clipp::value("authors dump", authorsFilepath))
+			.doc("resolve edition authors by key, most editions name them no other way"),
+		(clipp::required("-o", "--output") & clipp::value("ISBN index file", indexFilepath)));
+
+	auto cli = (mergeCli | importCli | scanCli);
 
 	auto res = clipp::parse(argc, argv, cli);
 
@@ -321,13 +697,59 @@ int main(int argc, char* argv[]) {
 		return 0;
 	}
 
+	if (merge) {
+		// the existing output is merged too so shards can be folded in as they finish
+		if (std::filesystem::exists(outputJsonFilepath)) {
+			mergeInputs.insert(mergeInputs.begin(), outputJsonFilepath);
+		}
+		auto merged = merge_output_files(mergeInputs);
+		write_output_json(outputJsonFilepath, merged);
+		console_log()->info("main(): merged {} records into {}", merged.size(), outputJsonFilepath);
+		return 0;
+	}
+
+	if (importIndex) {
+		std::ifstream dump(dumpFilepath);
+		if (!dump) {
+			error_log()->error("could not open {}", dumpFilepath);
+			return 0;
+		}
+
+		OpenLibraryAuthors authors{};
+		if (!authorsFilepath.empty()) {
+			std::ifstream authorsDump(authorsFilepath);
+			if (!authorsDump) {
+				error_log()->error("could not open {}", authorsFilepath);
+				return 0;
+			}
+			console_log()->info("main(): loaded {} authors from {}", authors.load(authorsDump), authorsFilepath);
+		}
+
+		IsbnIndexWriter writer{};
+		const auto editions = import_open_library(dump, writer, authorsFilepath.empty() ? nullptr : &authors);
+		if (!writer.write(indexFilepath)) {
+			error_log()->error("could not write {}", indexFilepath);
+			return 0;
+		}
+
+		console_log()->info("main(): indexed {} ISBNs from {} editions into {}", writer.size(), editions,
+							indexFilepath);
+		return 0;
+	}
+
+	auto shard = parse_shard(shardSpec);
+	if (!shard.has_value()) {
+		error_log()->error("invalid shard {}, expected i/N with 0 <= i < N", shardSpec);
+		return 0;
+	}
+
 	ASSERT(!(debug && verbose));
 
-	console_log->set_level(spdlog::level::warn);
+	console_log()->set_level(spdlog::level::warn);
 	if (verbose) {
-		console_log->set_level(spdlog::level::info);
+		console_log()->set_level(spdlog::level::info);
 	} else if (debug) {
-		console_log->set_level(spdlog::level::debug);
+		console_log()->set_level(spdlog::level::debug);
 	}
 
 	json filetypes;
@@ -336,7 +758,7 @@ int main(int argc, char* argv[]) {
 		filetypes = json::parse(filetypesJson);
 		filetypesJson.close();
 	} catch (const std::exception& err) {
-		error_log->error("could not open {} for filetypes (MIME types)", filetypesJsonPath);
+		error_log()->error("could not open {} for filetypes (MIME types)", filetypesJsonPath);
 		return 0;
 	}
 
@@ -358,77 +780,364 @@ int main(int argc, char* argv[]) {
 	auto max_chars = config["option"]["max_characters_to_search"].value<long>().value();
 	ASSERT(max_chars > 0);
 
+	auto max_lookups = config["option"]["max_lookups_per_file"].value_or<long>(5);
+	ASSERT(max_lookups > 0);
+
+	auto confident_title_match = config["option"]["confident_title_match"].value_or<double>(0.8);
+
+	const ScanOptions options{static_cast<size_t>(max_chars), static_cast<size_t>(max_lookups),
+							  confident_title_match};
+
 	auto tika_host = config["tika"]["host"].value<std::string>();
 	auto tika_port = config["tika"]["port"].value<int>();
-	const Tika tika{tika_host.value(), tika_port.value()};
+	Tika tika{};
+	tika.host = tika_host.value();
+	tika.port = tika_port.value();
+	configure_host(config["tika"], tika);
+	if (auto hedge_host = config["tika"]["hedge_host"].value<std::string>()) {
+		Host hedge{hedge_host.value(), config["tika"]["hedge_port"].value_or<int>(tika.port)};
+		configure_host(config["tika"], hedge);
+		tika.hedge = hedge;
+		tika.hedge_percentile = config["tika"]["hedge_percentile"].value_or<double>(95.0);
+	}
 
 	auto worldcat_host = config["worldcat"]["host"].value<std::string>();
 	auto worldcat_port = config["worldcat"]["port"].value<int>();
 	auto worldcat_path = config["worldcat"]["path"].value<std::string>();
 	auto worldcat_rate = config["worldcat"]["rate_milliseconds"].value<int>();
 	WorldCat worldCatInfo{{worldcat_host.value(), worldcat_port.value()}, worldcat_path.value()};
+	configure_host(config["worldcat"], worldCatInfo);
+	const auto worldCatRetry = worldCatInfo.retry;
 	RateLimited<WorldCat, std::string> worldCat{std::move(worldCatInfo),
 												std::chrono::milliseconds(worldcat_rate.value())};
+	CancellationToken cancellation{};
+	WorldCatProvider worldCatProvider{worldCat, worldCatRetry};
+
+	std::vector<MetadataProvider*> providers{};
+	std::optional<IsbnIndex> offlineIndex{};
+	std::optional<OfflineProvider> offlineProvider{};
+	if (auto index_path = config["offline"]["index"].value<std::string>()) {
+		offlineIndex.emplace(index_path.value());
+		if (!offlineIndex->is_open()) {
+			return 0;
+		}
+		console_log()->info("main(): using offline index {} with {} ISBNs", index_path.value(), offlineIndex->size());
+		offlineProvider.emplace(offlineIndex.value());
+		providers.push_back(&offlineProvider.value());
+	}
+	providers.push_back(&worldCatProvider);
+	ProviderChain metadata{std::move(providers)};
 
-	console_log->info("main(): gathering files...");
+	auto schedule_policy_name = config["schedule"]["policy"].value_or<std::string>("shortest_first");
+	auto schedule_policy = magic_enum::enum_cast<SchedulePolicy>(schedule_policy_name);
+	if (!schedule_policy.has_value()) {
+		error_log()->error("unknown schedule policy {}", schedule_policy_name);
+		return 0;
+	}
+	auto large_file_slots = config["schedule"]["large_file_slots"].value_or<long>(1);
+	ASSERT(large_file_slots >= 0);
+
+	std::unique_ptr<TextCache> textCache{};
+	if (auto cache_directory = config["cache"]["directory"].value<std::string>()) {
+		auto extractor_version = config["cache"]["extractor_version"].value<std::string>();
+		if (!extractor_version.has_value()) {
+			extractor_version = get_tika_version(tika);
+		}
 
-	auto files = std::vector<std::string>{};
-	for (const auto& filepath : std::filesystem::recursive_directory_iterator(inDirectory)) {
-		if (filepath.is_directory()) {
-			continue;
+		auto cache_characters = config["cache"]["max_characters"].value_or<long>(100000);
+		auto cache_megabytes = config["cache"]["max_megabytes"].value_or<long>(1024);
+		auto cache_level = config["cache"]["compression_level"].value_or<int>(3);
+		ASSERT(cache_characters > 0 && cache_megabytes > 0);
+
+		if (!extractor_version.has_value()) {
+			console_log()->warn("main(): could not get the Tika version, the text cache is disabled for this run");
+		} else {
+			if (cache_characters < max_chars) {
+				console_log()->warn("main(): cache max_characters {} is below max_characters_to_search {}, cached texts "
+									"will be searched only up to the former",
+									cache_characters, max_chars);
+			}
+
+			textCache = std::make_unique<TextCache>(cache_directory.value(),
+													static_cast<std::uintmax_t>(cache_megabytes) << 20,
+													static_cast<size_t>(cache_characters), extractor_version.value(),
+													cache_level);
+			console_log()->info("main(): text cache {} for {} holds {} texts", cache_directory.value(),
+								extractor_version.value(), textCache->size());
 		}
+	}
 
-		const auto filepathString = filepath.path().string();
-		if (processed_files.contains(filepathString)) {
-			spdlog::get("console")->info("skipping {} because it was processed on a previous run", filepathString);
-			continue;
+	auto watch_debounce = config["watch"]["debounce_milliseconds"].value_or<long>(2000);
+	ASSERT(watch_debounce >= 0);
+
+	auto shutdown_grace = config["shutdown"]["grace_seconds"].value_or<double>(10.0);
+	ASSERT(shutdown_grace >= 0);
+
+	const auto file_budget = std::chrono::duration_cast<std::chrono::milliseconds>(
+		std::chrono::duration<double>(config["budget"]["file_seconds"].value_or<double>(900.0)));
+	ASSERT(file_budget.count() >= 0);
+
+	// next to the output by default, so every shard keeps its own
+	auto quarantine_path = config["quarantine"]["file"].value_or<std::string>(
+		std::filesystem::path(outputJsonFilepath).replace_extension("quarantine.json").string());
+	auto quarantine_failures = config["quarantine"]["max_extraction_failures"].value_or<long>(3);
+	ASSERT(quarantine_failures > 0);
+	Quarantine quarantine{quarantine_path, static_cast<size_t>(quarantine_failures)};
+
+	auto make_work_item = [&](const std::filesystem::path& filepath, std::uint64_t size) -> std::optional<WorkItem> {
+		if (!in_shard(shard.value(), filepath.lexically_relative(inDirectory).generic_string())) {
+			return std::nullopt;
 		}
 
-		auto ext = get_file_extension(filepath.path().string());
-		if (!filetypes.contains(ext)) {
-			spdlog::get("console")->info("skipping {} because it does not have a supported file extension", filepathString);
+		// an extension filetypes.json does not list rules a file out without opening it, whether any other file is
+		// worth scanning is decided by its contents once a worker gets to it
+		const auto filepathString = filepath.string();
+		auto ext = get_file_extension(filepathString);
+		if (!ext.empty() && !filetypes.contains(ext)) {
+			LOG_DEBUG("main(): skipping {} because it does not have a supported file extension", filepathString);
+			return std::nullopt;
 		}
 
-		files.push_back(filepath.path());
-	}
+		return WorkItem{filepathString, ext, size};
+	};
 
-	console_log->info("main(): {} files found", files.size());
+	// archives are walked like directories, every file in one is scheduled on its own as archive!/member
+	Archives archives{};
+	auto make_work_items = [&](const std::filesystem::path& filepath) {
+		std::vector<WorkItem> items{};
+
+		if (archive_format(filepath.string()).has_value()) {
+			if (auto members = archives.list(filepath.string())) {
+				for (const auto& [member_path, size] : members.value()) {
+					if (auto item = make_work_item(member_path, size)) {
+						items.push_back(std::move(item.value()));
+					}
+				}
+			}
+			return items;
+		}
 
-	auto writeOutputJson = [&outputJsonFilepath](auto& out) {
-		if (out.empty()) {
-			return;
+		std::error_code size_error{};
+		auto size = std::filesystem::file_size(filepath, size_error);
+		if (size_error) {
+			size = 0;
 		}
 
-		std::ofstream fh(outputJsonFilepath);
-		std::string str{out.dump(4)};
-		fh.write(str.data(), static_cast<long>(str.size()));
-		fh.close();
+		if (auto item = make_work_item(filepath, size)) {
+			items.push_back(std::move(item.value()));
+		}
+		return items;
 	};
 
-	Lockable<json> output{std::move(previousBooks)};
+	// started before the initial walk so nothing that lands during it is missed
+	std::optional<DirectoryWatcher> watcher{};
+	if (watch) {
+		watcher.emplace(inDirectory, std::chrono::milliseconds(watch_debounce));
+		if (!watcher->watching()) {
+			error_log()->error("could not watch {}", inDirectory);
+			return 0;
+		}
+	}
 
-	auto handler = [](int signalNum) {
-		spdlog::get("console")->debug("signal {} received", signalNum);
-		signalReceived = signalNum;
+	auto writeOutputJson = [&outputJsonFilepath](auto& out) {
+		write_output_json(outputJsonFilepath, out);
 	};
-	std::signal(SIGINT, handler);
 
-	spdlog::get("console")->info("main(): beginning scanning");
+	Lockable<json> output{std::move(previousBooks)};
+
+	// declared after the output so it is stopped before the output goes away
+	ShutdownSignals shutdownSignals{
+		cancellation,
+		std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::duration<double>(shutdown_grace))};
+	// files finished so far are kept even when shutdown is forced
+	shutdownSignals.on_force([&output, &writeOutputJson]() {
+		output.use(writeOutputJson);
+	});
+
+	console_log()->info("main(): gathering files...");
+
+	auto files = std::vector<WorkItem>{};
+	for (const auto& filepath : std::filesystem::recursive_directory_iterator(inDirectory)) {
+		if (cancellation.cancelled()) {
+			break;
+		}
+
+		if (filepath.is_directory()) {
+			continue;
+		}
+
+		for (auto& item : make_work_items(filepath.path())) {
+			if (processed_files.contains(item.filepath)) {
+				console_log()->info("skipping {} because it was processed on a previous run", item.filepath);
+				continue;
+			}
+			if (!retryQuarantined && quarantine.contains(item.filepath)) {
+				console_log()->info("skipping {} because it is quarantined", item.filepath);
+				continue;
+			}
+			files.push_back(std::move(item));
+		}
+	}
+
+	console_log()->info("main(): {} files found", files.size());
+
+	auto io_queue_depth = config["io"]["queue_depth"].value_or<long>(64);
+	auto io_fallback_threads = config["io"]["fallback_threads"].value_or<long>(4);
+	ASSERT(io_queue_depth > 0 && io_fallback_threads > 0);
+	FileReader reader{static_cast<unsigned>(io_queue_depth), static_cast<size_t>(io_fallback_threads)};
+
+	console_log()->info("main(): beginning scanning");
+
+	Lockable<std::map<FileOutcome, size_t>> outcomes{};
+	auto record_outcome = [&](const std::string& filepath, FileOutcome outcome) {
+		outcomes.use([outcome](auto& counts) {
+			counts[outcome]++;
+		});
+
+		switch (outcome) {
+			case FileOutcome::timed_out:
+				quarantine.record_failure(filepath, magic_enum::enum_name(outcome), true);
+				console_log()->warn("main(): quarantined {}, it took longer than {}s", filepath,
+									std::chrono::duration<double>(file_budget).count());
+				break;
+			case FileOutcome::extraction_failed:
+				if (quarantine.record_failure(filepath, magic_enum::enum_name(outcome), false)) {
+					console_log()->warn("main(): quarantined {}, Tika failed on it {} times", filepath,
+										quarantine_failures);
+				}
+				break;
+			// none of these are the file's fault
+			case FileOutcome::read_failed:
+			case FileOutcome::tika_unreachable:
+			case FileOutcome::cancelled:
+				break;
+			default:
+				quarantine.clear(filepath);
+				break;
+		}
+	};
 
+	Deadlines deadlines{};
 	tf::Executor executor{};
 	tf::Taskflow taskflow{};
-	taskflow.for_each(files.begin(), files.end(), [&](const auto& filepath) {
-		if (signalReceived != -233) {
-			spdlog::get("console")->debug("signal acknowledged, writing output file");
-			output.use(writeOutputJson);
-			return;
-		}
-		process_file(filepath, static_cast<size_t>(max_chars), output, filetypes, tika, worldCat);
-	});
+	Scheduler scheduler{std::move(files), schedule_policy.value()};
+
+	// always leave at least one worker for the policy's own ordering
+	const auto workers = executor.num_workers();
+	const auto large_slots = std::min(static_cast<size_t>(large_file_slots), workers > 1 ? workers - 1 : 0);
+
+	for (size_t worker = 0; worker < workers; worker++) {
+		const bool large_slot = worker < large_slots;
+		taskflow.emplace([&, large_slot]() {
+			// once cancelled whatever is still queued is dropped, the output is written once everything has stopped
+			while (!cancellation.cancelled()) {
+				auto item = scheduler.next(large_slot);
+				if (!item) {
+					break;
+				}
+
+				// let the kernel start on the file this worker will most likely take next while this one is in Tika,
+				// unless it is an ebook whose metadata will most likely name its ISBNs and spare reading the rest of it
+				if (auto upcoming = scheduler.peek(large_slot);
+					upcoming && !is_archive_member_path(upcoming.value()) &&
+					!usually_declares_isbns(filetypes.value(get_file_extension(upcoming.value()), std::string{}))) {
+					reader.prefetch(upcoming.value());
+				}
+
+				// shutting down cancels the file's own token too, running out of budget stops only this file
+				CancellationToken fileCancellation{};
+				const auto forward = cancellation.on_cancel([&fileCancellation]() {
+					fileCancellation.cancel();
+				});
+				std::optional<Deadlines::Timer> budget{};
+				if (file_budget.count() > 0) {
+					budget.emplace(deadlines.start(fileCancellation, file_budget));
+				}
+
+				const auto start = std::chrono::steady_clock::now();
+				auto outcome = process_file(item->filepath, options, output, filetypes, tika, reader, archives,
+											textCache.get(), metadata, fileCancellation);
+				if (outcome == FileOutcome::cancelled && !cancellation.cancelled()) {
+					outcome = FileOutcome::timed_out;
+				}
+				record_outcome(item->filepath, outcome);
+				if (!cancellation.cancelled()) {
+					scheduler.record(*item, std::chrono::steady_clock::now() - start);
+				}
+			}
+		});
+	}
 	executor.run(taskflow).wait();
 
 	output.use(writeOutputJson);
 
+	if (!watch || cancellation.cancelled()) {
+		outcomes.use([&quarantine](auto& counts) {
+			report_run(counts, quarantine);
+		});
+		return 0;
+	}
+
+	console_log()->info("main(): initial scan done, watching {} for new files", inDirectory);
+
+	// the executor, its workers' connections and the rate limiter stay warm between batches
+	while (!cancellation.cancelled()) {
+		auto landed = watcher->poll(std::chrono::milliseconds(500));
+		if (landed.empty()) {
+			continue;
+		}
+
+		std::vector<WorkItem> batch{};
+		std::unordered_set<std::string> changed{};
+		std::vector<std::string> changed_archives{};
+		for (const auto& file : landed) {
+			if (archive_format(file.filepath.string()).has_value()) {
+				changed_archives.push_back(fmt::format("{}{}", file.filepath.string(), archive_separator));
+			}
+			for (auto& item : make_work_items(file.filepath)) {
+				// a changed file gets another chance even if an earlier version of it was quarantined
+				quarantine.clear(item.filepath);
+				changed.insert(item.filepath);
+				batch.push_back(std::move(item));
+			}
+		}
+
+		if (batch.empty() && changed_archives.empty()) {
+			continue;
+		}
+
+		// a changed file replaces whatever an earlier version of it produced, a changed archive everything from it
+		output.use([&changed, &changed_archives](json& out) {
+			out.erase(std::remove_if(out.begin(), out.end(),
+									 [&changed, &changed_archives](const json& book) {
+										 const auto filepath = book.value("filepath", std::string{});
+										 return changed.contains(filepath) ||
+												std::any_of(changed_archives.begin(), changed_archives.end(),
+															[&filepath](const std::string& archive) {
+																return filepath.starts_with(archive);
+															});
+									 }),
+					  out.end());
+		});
+
+		scheduler.add(std::move(batch));
+		executor.run(taskflow).wait();
+
+		output.use(writeOutputJson);
+
+		const auto oldest = std::min_element(landed.begin(), landed.end(), [](const auto& a, const auto& b) {
+			return a.landed < b.landed;
+		});
+		console_log()->info("main(): processed {} new files, {:.1f}s after the first of them landed", changed.size(),
+							std::chrono::duration<double>(std::chrono::steady_clock::now() - oldest->landed).count());
+	}
+
+	output.use(writeOutputJson);
+
+	outcomes.use([&quarantine](auto& counts) {
+		report_run(counts, quarantine);
+	});
+
 	return 0;
 }
 #endif
\ No newline at end of file
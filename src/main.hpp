@@ -14,10 +14,12 @@
    limitations under the License.
 */
 
+#include <array>
 #include <filesystem>
 #include <iostream>
 #include <fstream>
 #include <map>
+#include <random>
 #include <string>
 #include <unordered_set>
 #include <csignal>
@@ -39,17 +41,33 @@
 #include <taskflow.hpp>
 #include <unordered_set>
 #include <tao/tuple/tuple.hpp>
+#include <magic_enum.hpp>
 #include <chrono>
 
 #define TOML_HEADER_ONLY 0
 #define TOML_IMPLEMENTATION
 #include <toml++/toml.h>
 
+#include "log.hpp"
 #include "book.hpp"
 #include "lockable.hpp"
 #include "util.hpp"
 #include "version.hpp"
 #include "rate_limited.hpp"
+#include "scheduler.hpp"
+#include "shard.hpp"
+#include "watch.hpp"
+#include "metadata_provider.hpp"
+#include "isbn_index.hpp"
+#include "candidates.hpp"
+#include "file_reader.hpp"
+#include "retry.hpp"
+#include "text_cache.hpp"
+#include "cancellation.hpp"
+#include "sniff.hpp"
+#include "archive.hpp"
+#include "quarantine.hpp"
+#include "embedded_isbn.hpp"
 #include "test.hpp"
 
 #pragma once
@@ -0,0 +1,108 @@
+/*
+Copyright 2023 larkwiot
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+		http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include <spdlog/spdlog.h>
+
+#include "book.hpp"
+#include "cancellation.hpp"
+#include "log.hpp"
+#include "test.hpp"
+#include "util.hpp"
+
+#pragma once
+
+// Somewhere to look up the works for an ISBN. Implementations must be safe to call from every worker at once, and
+// should give up early once cancellation (which belongs to the file being looked up) is cancelled.
+class MetadataProvider {
+   public:
+	virtual ~MetadataProvider() = default;
+
+	virtual std::string name() const = 0;
+	virtual std::unordered_set<Book> lookup(ISBN isbn, CancellationToken& cancellation) = 0;
+};
+
+// Asks each provider in turn and returns the first non-empty answer, so cheap local providers go first and network
+// providers are only used on a miss
+class ProviderChain : public MetadataProvider {
+	std::vector<MetadataProvider*> _providers{};
+
+   public:
+	explicit ProviderChain(std::vector<MetadataProvider*>&& providers) : _providers(std::move(providers)){};
+
+	std::string name() const override {
+		return "chain";
+	}
+
+	std::unordered_set<Book> lookup(ISBN isbn, CancellationToken& cancellation) override {
+		for (auto* provider : _providers) {
+			if (cancellation.cancelled()) {
+				break;
+			}
+
+			auto books = provider->lookup(isbn, cancellation);
+			if (!books.empty()) {
+				return books;
+			}
+
+			LOG_DEBUG("ProviderChain: {} had nothing for {}", provider->name(), isbn);
+		}
+
+		return {};
+	}
+};
+
+TEST_CASE("ProviderChain") {
+	struct Fixed : public MetadataProvider {
+		ISBN known;
+		std::string title;
+		int calls = 0;
+
+		Fixed(ISBN _known, std::string _title) : known(_known), title(std::move(_title)){};
+
+		std::string name() const override {
+			return title;
+		}
+
+		std::unordered_set<Book> lookup(ISBN isbn, CancellationToken&) override {
+			calls++;
+			if (isbn != known) {
+				return {};
+			}
+			std::unordered_set<Book> books{};
+			books.emplace(isbn, "author", std::string{title}, 0, 0, "");
+			return books;
+		}
+	};
+
+	Fixed local{1, "local"};
+	Fixed remote{2, "remote"};
+	ProviderChain chain{{&local, &remote}};
+	CancellationToken cancellation{};
+
+	CHECK(chain.lookup(1, cancellation).begin()->title == "local");
+	CHECK(remote.calls == 0);
+	CHECK(chain.lookup(2, cancellation).begin()->title == "remote");
+	CHECK(chain.lookup(3, cancellation).empty());
+	CHECK(local.calls == 3);
+
+	cancellation.cancel();
+	CHECK(chain.lookup(1, cancellation).empty());
+	CHECK(local.calls == 3);
+}
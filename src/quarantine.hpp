@@ -0,0 +1,171 @@
+/*
+Copyright 2023 larkwiot
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+		http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <unistd.h>
+
+#include <nlohmann/json.hpp>
+#include <spdlog/spdlog.h>
+
+#include "log.hpp"
+#include "test.hpp"
+
+#pragma once
+
+struct QuarantineEntry {
+	// what went wrong the last time
+	std::string reason{};
+	std::size_t failures{};
+	bool quarantined = false;
+};
+
+// Files that ran out of time or kept failing, kept in a JSON file so later runs can skip them instead of losing a
+// worker to them again. Files that failed fewer than max_failures times are remembered too, only to count failures
+// across runs. Every change is written out right away, a crash caused by one of these files must not lose it.
+class Quarantine {
+	std::filesystem::path _path;
+	std::size_t _max_failures;
+	mutable std::mutex _mutex{};
+	std::map<std::string, QuarantineEntry> _entries{};
+
+	// with _mutex held
+	void save() const {
+		auto out = nlohmann::json::object();
+		for (const auto& [filepath, entry] : _entries) {
+			out[filepath] = {
+				{"reason", entry.reason}, {"failures", entry.failures}, {"quarantined", entry.quarantined}};
+		}
+
+		std::error_code error{};
+		const auto temporary = _path.string() + fmt::format(".{}.tmp", getpid());
+		{
+			std::ofstream fh(temporary, std::ios::trunc);
+			const auto str = out.dump(4);
+			fh.write(str.data(), static_cast<long>(str.size()));
+			if (!fh) {
+				console_log()->warn("Quarantine: could not write {}", temporary);
+				std::filesystem::remove(temporary, error);
+				return;
+			}
+		}
+		std::filesystem::rename(temporary, _path, error);
+		if (error) {
+			console_log()->warn("Quarantine: could not replace {}: {}", _path.string(), error.message());
+			std::filesystem::remove(temporary, error);
+		}
+	}
+
+   public:
+	Quarantine(std::filesystem::path path, std::size_t max_failures)
+		: _path(std::move(path)), _max_failures(max_failures) {
+		if (!std::filesystem::exists(_path)) {
+			return;
+		}
+
+		try {
+			std::ifstream fh(_path);
+			const auto saved = nlohmann::json::parse(fh);
+			for (const auto& [filepath, entry] : saved.items()) {
+				_entries[filepath] = {entry.value("reason", std::string{}), entry.value("failures", std::size_t{0}),
+									  entry.value("quarantined", false)};
+			}
+		} catch (const std::exception& err) {
+			console_log()->warn("Quarantine: ignoring unreadable {}: {}", _path.string(), err.what());
+			_entries.clear();
+		}
+	}
+
+	bool contains(const std::string& filepath) const {
+		std::lock_guard lock{_mutex};
+		const auto entry = _entries.find(filepath);
+		return entry != _entries.end() && entry->second.quarantined;
+	}
+
+	// Counts a failure of filepath, quarantining it right away if immediate or once it has failed max_failures times.
+	// True if it is quarantined now.
+	bool record_failure(const std::string& filepath, std::string_view reason, bool immediate) {
+		std::lock_guard lock{_mutex};
+		auto& entry = _entries[filepath];
+		entry.reason = reason;
+		entry.failures++;
+		entry.quarantined = entry.quarantined || immediate || entry.failures >= _max_failures;
+		save();
+		return entry.quarantined;
+	}
+
+	// forgets filepath, for files that made it through or changed since they failed
+	void clear(const std::string& filepath) {
+		std::lock_guard lock{_mutex};
+		if (_entries.erase(filepath) > 0) {
+			save();
+		}
+	}
+
+	std::vector<std::pair<std::string, QuarantineEntry>> quarantined() const {
+		std::lock_guard lock{_mutex};
+		std::vector<std::pair<std::string, QuarantineEntry>> files{};
+		for (const auto& [filepath, entry] : _entries) {
+			if (entry.quarantined) {
+				files.emplace_back(filepath, entry);
+			}
+		}
+		return files;
+	}
+};
+
+TEST_CASE("Quarantine") {
+	const auto path = std::filesystem::temp_directory_path() / fmt::format("isbn_scanner_quarantine_{}.json", getpid());
+	std::filesystem::remove(path);
+
+	{
+		Quarantine quarantine{path, 3};
+		CHECK(quarantine.record_failure("slow.pdf", "timed_out", true));
+		CHECK(!quarantine.record_failure("broken.pdf", "extraction_failed", false));
+		CHECK(!quarantine.record_failure("flaky.pdf", "extraction_failed", false));
+		CHECK(!quarantine.record_failure("broken.pdf", "extraction_failed", false));
+		CHECK(quarantine.contains("slow.pdf"));
+		CHECK(!quarantine.contains("broken.pdf"));
+		quarantine.clear("flaky.pdf");
+	}
+
+	{
+		// failures add up across runs
+		Quarantine quarantine{path, 3};
+		CHECK(quarantine.record_failure("broken.pdf", "extraction_failed", false));
+		CHECK(!quarantine.contains("flaky.pdf"));
+		CHECK(!quarantine.record_failure("flaky.pdf", "extraction_failed", false));
+
+		const auto files = quarantine.quarantined();
+		REQUIRE(files.size() == 2);
+		CHECK(files[0].first == "broken.pdf");
+		CHECK(files[0].second.failures == 3);
+		CHECK(files[1].first == "slow.pdf");
+		CHECK(files[1].second.reason == "timed_out");
+
+		quarantine.clear("slow.pdf");
+		CHECK(!quarantine.contains("slow.pdf"));
+	}
+
+	std::filesystem::remove(path);
+}
@@ -3,6 +3,8 @@
 #include <mutex>
 #include <thread>
 
+#include "cancellation.hpp"
+
 #pragma once
 
 template <typename T, typename U>
@@ -23,14 +25,21 @@ class RateLimited {
 		_mutex.unlock();
 	};
 
-	U use(const std::function<U(T&)>& function) {
+	// with a cancellation token the wait for the next slot ends early once it is cancelled, function still runs and is
+	// expected to check the token itself
+	U use(const std::function<U(T&)>& function, const CancellationToken* cancellation = nullptr) {
 		_mutex.lock();
 
 		auto now = std::chrono::high_resolution_clock::now();
 		auto difference = _interval - (now - _last_use);
-		std::this_thread::sleep_for(difference);
+		if (cancellation == nullptr) {
+			std::this_thread::sleep_for(difference);
+		} else {
+			cancellation->sleep_for(difference);
+		}
 
 		U result = function(_item);
+		_last_use = std::chrono::high_resolution_clock::now();
 
 		_mutex.unlock();
 
@@ -0,0 +1,319 @@
+/*
+Copyright 2023 larkwiot
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+		http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "cancellation.hpp"
+#include "test.hpp"
+
+#pragma once
+
+struct RetryPolicy {
+	// total tries, including the first
+	int attempts = 1;
+	std::chrono::milliseconds base_delay{500};
+	std::chrono::milliseconds max_delay{10000};
+};
+
+// "full jitter" exponential backoff: uniformly random up to base * 2^retry, capped, so retrying workers spread out
+std::chrono::milliseconds backoff_delay(const RetryPolicy& policy, int retry) {
+	thread_local std::mt19937_64 random{std::random_device{}()};
+
+	const auto ceiling = std::min(policy.max_delay.count(), policy.base_delay.count() << std::min(retry, 30));
+	std::uniform_int_distribution<long> jitter{0, std::max(ceiling, 0l)};
+	return std::chrono::milliseconds(jitter(random));
+}
+
+TEST_CASE("backoff_delay()") {
+	const RetryPolicy policy{5, std::chrono::milliseconds(100), std::chrono::milliseconds(1000)};
+	for (int retry = 0; retry < 40; retry++) {
+		const auto delay = backoff_delay(policy, retry);
+		CHECK(delay.count() >= 0);
+		CHECK(delay.count() <= std::min(1000l, 100l << std::min(retry, 30)));
+	}
+}
+
+// Calls attempt until it gives a result transient() does not object to, or the policy runs out of attempts, sleeping
+// with backoff in between. Returns the last result either way, also as soon as cancellation is cancelled.
+template <typename T>
+T with_retries(const RetryPolicy& policy,
+			   const std::function<T()>& attempt,
+			   const std::function<bool(const T&)>& transient,
+			   const CancellationToken* cancellation = nullptr) {
+	for (int retry = 0;; retry++) {
+		T result = attempt();
+		if (retry + 1 >= policy.attempts || !transient(result)) {
+			return result;
+		}
+
+		const auto delay = backoff_delay(policy, retry);
+		if (cancellation == nullptr) {
+			std::this_thread::sleep_for(delay);
+		} else if (!cancellation->sleep_for(delay)) {
+			return result;
+		}
+	}
+}
+
+TEST_CASE("with_retries()") {
+	const RetryPolicy policy{3, std::chrono::milliseconds(1), std::chrono::milliseconds(2)};
+
+	int calls = 0;
+	const std::function<int()> failing = [&calls]() {
+		return ++calls;
+	};
+	const std::function<bool(const int&)> below_two = [](const int& result) {
+		return result < 2;
+	};
+	CHECK(with_retries(policy, failing, below_two) == 2);
+	CHECK(calls == 2);
+
+	calls = 0;
+	const std::function<bool(const int&)> always = [](const int&) {
+		return true;
+	};
+	CHECK(with_retries(policy, failing, always) == 3);
+	CHECK(calls == 3);
+
+	calls = 0;
+	CancellationToken cancelled{};
+	cancelled.cancel();
+	CHECK(with_retries(policy, failing, always, &cancelled) == 1);
+	CHECK(calls == 1);
+}
+
+// Recent request latencies, for picking a hedging delay that only the slow tail will exceed. Latencies are kept per
+// byte uploaded so a large file is not hedged just for being large, small files count as minimum_bytes since their
+// time is mostly fixed overhead rather than transfer and parsing.
+class LatencyTracker {
+	static constexpr std::size_t capacity = 256;
+	static constexpr std::size_t minimum_samples = 20;
+	static constexpr std::size_t minimum_bytes = 64 * 1024;
+
+	std::mutex _mutex{};
+	std::vector<double> _samples{};
+	std::size_t _next{};
+
+	static double weight(std::size_t bytes) {
+		return static_cast<double>(std::max(bytes, minimum_bytes));
+	}
+
+   public:
+	void record(std::chrono::duration<double> latency, std::size_t bytes) {
+		const auto per_byte = latency.count() / weight(bytes);
+		std::lock_guard lock{_mutex};
+		if (_samples.size() < capacity) {
+			_samples.push_back(per_byte);
+		} else {
+			_samples[_next] = per_byte;
+		}
+		_next = (_next + 1) % capacity;
+	}
+
+	// how long a request of bytes takes at percentile p, nothing until enough requests have been seen for the
+	// percentile to mean something
+	std::optional<std::chrono::duration<double>> percentile(double p, std::size_t bytes) {
+		std::vector<double> samples;
+		{
+			std::lock_guard lock{_mutex};
+			if (_samples.size() < minimum_samples) {
+				return std::nullopt;
+			}
+			samples = _samples;
+		}
+
+		const auto rank = static_cast<std::size_t>(std::clamp(p, 0.0, 100.0) / 100.0 *
+												   static_cast<double>(samples.size() - 1));
+		std::nth_element(samples.begin(), samples.begin() + static_cast<long>(rank), samples.end());
+		return std::chrono::duration<double>(samples[rank] * weight(bytes));
+	}
+};
+
+TEST_CASE("LatencyTracker") {
+	constexpr std::size_t mib = 1024 * 1024;
+
+	LatencyTracker latencies{};
+	latencies.record(std::chrono::seconds(1), mib);
+	CHECK(!latencies.percentile(95, mib).has_value());
+
+	for (int i = 1; i <= 100; i++) {
+		latencies.record(std::chrono::milliseconds(i), mib);
+	}
+	// 101 samples: 1ms to 100ms plus the 1s one, all for 1 MiB
+	CHECK(latencies.percentile(50, mib)->count() == doctest::Approx(0.051));
+	CHECK(latencies.percentile(100, mib)->count() == doctest::Approx(1.0));
+
+	// scaled by size, with small files counted as 64 KiB
+	CHECK(latencies.percentile(50, 10 * mib)->count() == doctest::Approx(0.51));
+	CHECK(latencies.percentile(50, 1)->count() == doctest::Approx(0.051 / 16));
+	CHECK(latencies.percentile(50, 0)->count() == latencies.percentile(50, 64 * 1024)->count());
+}
+
+// Runs attempt(0) on the calling thread. If it has not finished after delay, attempt(1) is started on a second thread
+// (e.g. against another endpoint) and whichever succeeds first is returned. The loser is aborted by cancelling the
+// token passed to it, which it must check before and while it does anything slow, and by abort(i), which must make it
+// give up quickly if it is already blocked (e.g. by stopping its connection). Without a delay this is just attempt(0).
+template <typename T>
+T hedged(const std::function<T(std::size_t, CancellationToken&)>& attempt,
+		 const std::function<void(std::size_t)>& abort,
+		 const std::function<bool(const T&)>& succeeded,
+		 std::optional<std::chrono::duration<double>> delay) {
+	std::array<CancellationToken, 2> aborted{};
+	if (!delay.has_value()) {
+		return attempt(0, aborted[0]);
+	}
+
+	// abort(i) alone misses an attempt that has not opened its connection yet, the token catches it once it does
+	const auto abort_attempt = [&aborted, &abort](std::size_t i) {
+		aborted[i].cancel();
+		abort(i);
+	};
+
+	std::mutex mutex{};
+	std::condition_variable primary_finished{};
+	bool primary_done = false;
+	bool hedge_started = false;
+	std::optional<T> hedge_result{};
+
+	std::thread hedger{[&]() {
+		{
+			std::unique_lock lock{mutex};
+			if (primary_finished.wait_for(lock, delay.value(), [&primary_done]() {
+					return primary_done;
+				})) {
+				return;
+			}
+			hedge_started = true;
+		}
+
+		T result = attempt(1, aborted[1]);
+		const bool ok = succeeded(result);
+		{
+			std::lock_guard lock{mutex};
+			hedge_result.emplace(std::move(result));
+		}
+		if (ok) {
+			abort_attempt(0);
+		}
+	}};
+
+	T primary = attempt(0, aborted[0]);
+	const bool primary_ok = succeeded(primary);
+
+	bool abort_hedge = false;
+	{
+		std::lock_guard lock{mutex};
+		primary_done = true;
+		abort_hedge = primary_ok && hedge_started && !hedge_result.has_value();
+	}
+	primary_finished.notify_all();
+
+	if (abort_hedge) {
+		abort_attempt(1);
+	}
+	hedger.join();
+
+	if (!primary_ok && hedge_result.has_value() && succeeded(hedge_result.value())) {
+		return std::move(hedge_result.value());
+	}
+	return primary;
+}
+
+TEST_CASE("hedged()") {
+	const std::function<bool(const int&)> positive = [](const int& result) {
+		return result > 0;
+	};
+	const std::function<void(std::size_t)> ignore = [](std::size_t) {};
+
+	SUBCASE("fast primary never hedges") {
+		int hedges = 0;
+		const std::function<int(std::size_t, CancellationToken&)> attempt = [&hedges](std::size_t endpoint,
+																					   CancellationToken&) {
+			hedges += endpoint == 1 ? 1 : 0;
+			return 1;
+		};
+		CHECK(hedged(attempt, ignore, positive, std::chrono::duration<double>(1.0)) == 1);
+		CHECK(hedges == 0);
+	}
+
+	SUBCASE("slow primary loses to the hedge") {
+		std::mutex mutex{};
+		std::condition_variable aborted{};
+		bool primary_aborted = false;
+
+		const std::function<int(std::size_t, CancellationToken&)> attempt = [&](std::size_t endpoint,
+																				CancellationToken&) {
+			if (endpoint == 1) {
+				return 2;
+			}
+			std::unique_lock lock{mutex};
+			aborted.wait_for(lock, std::chrono::seconds(10), [&primary_aborted]() {
+				return primary_aborted;
+			});
+			return 0;
+		};
+		const std::function<void(std::size_t)> abort = [&](std::size_t endpoint) {
+			if (endpoint == 0) {
+				std::lock_guard lock{mutex};
+				primary_aborted = true;
+				aborted.notify_all();
+			}
+		};
+
+		CHECK(hedged(attempt, abort, positive, std::chrono::duration<double>(0.01)) == 2);
+		CHECK(primary_aborted);
+	}
+
+	SUBCASE("a hedge that has not connected yet is still aborted") {
+		std::mutex mutex{};
+		std::condition_variable started{};
+		bool hedge_started = false;
+		bool hedge_aborted = false;
+
+		// abort() does nothing, as stopping a client that has no connection yet does nothing
+		const std::function<int(std::size_t, CancellationToken&)> attempt = [&](std::size_t endpoint,
+																				CancellationToken& aborted) {
+			if (endpoint == 0) {
+				std::unique_lock lock{mutex};
+				started.wait_for(lock, std::chrono::seconds(10), [&hedge_started]() {
+					return hedge_started;
+				});
+				return 1;
+			}
+			{
+				std::lock_guard lock{mutex};
+				hedge_started = true;
+			}
+			started.notify_all();
+			hedge_aborted = !aborted.sleep_for(std::chrono::seconds(10));
+			return 0;
+		};
+
+		const auto start = std::chrono::steady_clock::now();
+		CHECK(hedged(attempt, ignore, positive, std::chrono::duration<double>(0.01)) == 1);
+		CHECK(hedge_aborted);
+		CHECK(std::chrono::steady_clock::now() - start < std::chrono::seconds(5));
+	}
+}
@@ -0,0 +1,284 @@
+/*
+Copyright 2023 larkwiot
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+		http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "test.hpp"
+
+#pragma once
+
+enum class SchedulePolicy {
+	// walk order, what a plain for_each over the directory would do
+	directory_order,
+	// cheapest expected file first, gets most of the library done early
+	shortest_first,
+	// most expensive expected file first, minimizes makespan
+	longest_first,
+};
+
+struct WorkItem {
+	std::string filepath;
+	std::string extension;
+	std::uintmax_t size{};
+};
+
+// Per-extension seconds-per-byte learned from files finished during this run
+class CostModel {
+	struct Sample {
+		double seconds{};
+		double bytes{};
+	};
+
+	std::map<std::string, Sample> _samples{};
+	Sample _total{};
+
+   public:
+	void record(const std::string& extension, std::uintmax_t size, std::chrono::duration<double> elapsed) {
+		// count empty files as one byte so they still teach us something about per-file overhead
+		const auto bytes = static_cast<double>(std::max<std::uintmax_t>(size, 1));
+		auto& sample = _samples[extension];
+		sample.seconds += elapsed.count();
+		sample.bytes += bytes;
+		_total.seconds += elapsed.count();
+		_total.bytes += bytes;
+	}
+
+	double seconds_per_byte(const std::string& extension) const {
+		const auto found = _samples.find(extension);
+		if (found != _samples.end() && found->second.bytes > 0) {
+			return found->second.seconds / found->second.bytes;
+		}
+
+		if (_total.bytes > 0) {
+			return _total.seconds / _total.bytes;
+		}
+
+		// nothing timed yet, so every type costs the same and size alone decides
+		return 1.0;
+	}
+
+	double estimate(const WorkItem& item) const {
+		return seconds_per_byte(item.extension) * static_cast<double>(std::max<std::uintmax_t>(item.size, 1));
+	}
+};
+
+TEST_CASE("CostModel") {
+	CostModel costs{};
+	CHECK(costs.estimate({"a.pdf", "pdf", 10}) < costs.estimate({"b.epub", "epub", 20}));
+
+	costs.record("pdf", 100, std::chrono::seconds(10));
+	costs.record("epub", 100, std::chrono::seconds(1));
+	CHECK(costs.estimate({"a.pdf", "pdf", 10}) > costs.estimate({"b.epub", "epub", 20}));
+
+	// unseen types fall back to the run-wide average
+	CHECK(costs.seconds_per_byte("mobi") == doctest::Approx(11.0 / 200.0));
+}
+
+// Hands out files to workers ordered by their expected processing cost. Files are kept in one size-sorted queue per
+// extension, so picking the cheapest or most expensive file only compares the ends of a handful of queues, and newly
+// learned per-type timings take effect immediately without re-sorting anything.
+class Scheduler {
+	std::mutex _mutex{};
+	SchedulePolicy _policy;
+	std::deque<WorkItem> _in_order{};
+	std::map<std::string, std::deque<WorkItem>> _by_extension{};
+	CostModel _costs{};
+	std::size_t _remaining{};
+
+	std::deque<WorkItem>* queue_by_cost(bool most_expensive) {
+		std::deque<WorkItem>* best_queue = nullptr;
+		double best_cost = 0.0;
+
+		for (auto& [extension, queue] : _by_extension) {
+			if (queue.empty()) {
+				continue;
+			}
+
+			const auto& candidate = most_expensive ? queue.back() : queue.front();
+			const auto cost = _costs.estimate(candidate);
+
+			if (best_queue == nullptr || (most_expensive ? cost > best_cost : cost < best_cost)) {
+				best_queue = &queue;
+				best_cost = cost;
+			}
+		}
+
+		return best_queue;
+	}
+
+	std::deque<WorkItem>* queue_for(bool large_slot) {
+		if (_policy == SchedulePolicy::directory_order) {
+			return &_in_order;
+		}
+		return queue_by_cost(takes_from_back(large_slot));
+	}
+
+	bool takes_from_back(bool large_slot) const {
+		return _policy != SchedulePolicy::directory_order && (large_slot || _policy == SchedulePolicy::longest_first);
+	}
+
+	std::optional<WorkItem> pop(bool large_slot) {
+		auto* best_queue = queue_for(large_slot);
+		if (best_queue == nullptr || best_queue->empty()) {
+			return std::nullopt;
+		}
+
+		WorkItem item;
+		if (takes_from_back(large_slot)) {
+			item = std::move(best_queue->back());
+			best_queue->pop_back();
+		} else {
+			item = std::move(best_queue->front());
+			best_queue->pop_front();
+		}
+
+		return item;
+	}
+
+   public:
+	explicit Scheduler(std::vector<WorkItem>&& items, SchedulePolicy policy) : _policy(policy), _remaining(items.size()) {
+		if (_policy == SchedulePolicy::directory_order) {
+			_in_order.assign(std::make_move_iterator(items.begin()), std::make_move_iterator(items.end()));
+			return;
+		}
+
+		std::stable_sort(items.begin(), items.end(), [](const WorkItem& a, const WorkItem& b) {
+			return a.size < b.size;
+		});
+
+		for (auto& item : items) {
+			_by_extension[item.extension].push_back(std::move(item));
+		}
+	}
+
+	// queues more work, e.g. files that showed up after the initial scan, keeping everything learned so far
+	void add(std::vector<WorkItem>&& items) {
+		std::lock_guard lock{_mutex};
+		_remaining += items.size();
+
+		for (auto& item : items) {
+			if (_policy == SchedulePolicy::directory_order) {
+				_in_order.push_back(std::move(item));
+				continue;
+			}
+
+			auto& queue = _by_extension[item.extension];
+			const auto position =
+				std::upper_bound(queue.begin(), queue.end(), item.size, [](std::uintmax_t size, const WorkItem& other) {
+					return size < other.size;
+				});
+			queue.insert(position, std::move(item));
+		}
+	}
+
+	// large_slot workers always take the most expensive file left so big files keep making progress while the rest of
+	// the pool works through the cheap ones
+	std::optional<WorkItem> next(bool large_slot = false) {
+		std::lock_guard lock{_mutex};
+
+		auto item = pop(large_slot);
+		if (item) {
+			_remaining--;
+		}
+
+		return item;
+	}
+
+	// the file next(large_slot) would return right now, so its reads can be started early
+	std::optional<std::string> peek(bool large_slot = false) {
+		std::lock_guard lock{_mutex};
+
+		const auto* queue = queue_for(large_slot);
+		if (queue == nullptr || queue->empty()) {
+			return std::nullopt;
+		}
+
+		return takes_from_back(large_slot) ? queue->back().filepath : queue->front().filepath;
+	}
+
+	void record(const WorkItem& item, std::chrono::duration<double> elapsed) {
+		std::lock_guard lock{_mutex};
+		_costs.record(item.extension, item.size, elapsed);
+	}
+
+	std::size_t remaining() {
+		std::lock_guard lock{_mutex};
+		return _remaining;
+	}
+};
+
+TEST_CASE("Scheduler") {
+	auto make_items = []() {
+		return std::vector<WorkItem>{
+			{"big.pdf", "pdf", 9000},
+			{"small.epub", "epub", 10},
+			{"medium.pdf", "pdf", 500},
+			{"tiny.pdf", "pdf", 5},
+		};
+	};
+
+	SUBCASE("directory order") {
+		Scheduler scheduler{make_items(), SchedulePolicy::directory_order};
+		CHECK(scheduler.next()->filepath == "big.pdf");
+		CHECK(scheduler.next(true)->filepath == "small.epub");
+		CHECK(scheduler.remaining() == 2);
+	}
+
+	SUBCASE("shortest first") {
+		Scheduler scheduler{make_items(), SchedulePolicy::shortest_first};
+		CHECK(scheduler.peek() == "tiny.pdf");
+		CHECK(scheduler.next()->filepath == "tiny.pdf");
+		CHECK(scheduler.peek(true) == "big.pdf");
+		CHECK(scheduler.next(true)->filepath == "big.pdf");
+		CHECK(scheduler.next()->filepath == "small.epub");
+		CHECK(scheduler.next()->filepath == "medium.pdf");
+		CHECK(!scheduler.next().has_value());
+		CHECK(!scheduler.peek().has_value());
+		CHECK(scheduler.remaining() == 0);
+	}
+
+	SUBCASE("longest first") {
+		Scheduler scheduler{make_items(), SchedulePolicy::longest_first};
+		CHECK(scheduler.next()->filepath == "big.pdf");
+		CHECK(scheduler.next()->filepath == "medium.pdf");
+	}
+
+	SUBCASE("added work is ordered with the rest") {
+		Scheduler scheduler{make_items(), SchedulePolicy::shortest_first};
+		scheduler.add({{"late.pdf", "pdf", 7}, {"huge.pdf", "pdf", 99999}});
+		CHECK(scheduler.remaining() == 6);
+		CHECK(scheduler.next()->filepath == "tiny.pdf");
+		CHECK(scheduler.next()->filepath == "late.pdf");
+		CHECK(scheduler.next(true)->filepath == "huge.pdf");
+	}
+
+	SUBCASE("learned timings reorder types") {
+		Scheduler scheduler{make_items(), SchedulePolicy::shortest_first};
+		// PDFs turn out to be far slower per byte than EPUBs
+		scheduler.record({"x.pdf", "pdf", 10}, std::chrono::seconds(10));
+		scheduler.record({"y.epub", "epub", 1000}, std::chrono::seconds(1));
+		CHECK(scheduler.next()->filepath == "small.epub");
+		CHECK(scheduler.next()->filepath == "tiny.pdf");
+	}
+}
@@ -0,0 +1,176 @@
+/*
+Copyright 2023 larkwiot
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+		http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include <cstdint>
+#include <fstream>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_set>
+#include <vector>
+
+#include <nlohmann/json.hpp>
+#include <spdlog/spdlog.h>
+
+#include "log.hpp"
+#include "test.hpp"
+
+#pragma once
+
+using json = nlohmann::json;
+
+struct Shard {
+	std::size_t index{};
+	std::size_t count{1};
+};
+
+// FNV-1a, unlike std::hash this gives the same value on every host and build
+constexpr std::uint64_t stable_path_hash(std::string_view path) {
+	std::uint64_t hash = 14695981039346656037ull;
+	for (auto c : path) {
+		hash ^= static_cast<unsigned char>(c);
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+TEST_CASE("stable_path_hash()") {
+	CHECK(stable_path_hash("") == 14695981039346656037ull);
+	CHECK(stable_path_hash("a") == 0xaf63dc4c8601ec8cull);
+	CHECK(stable_path_hash("books/a.pdf") != stable_path_hash("books/b.pdf"));
+}
+
+// parses "i/N" where 0 <= i < N
+std::optional<Shard> parse_shard(const std::string& spec) {
+	const auto slash = spec.find('/');
+	if (slash == std::string::npos) {
+		return std::nullopt;
+	}
+
+	Shard shard{};
+	try {
+		std::size_t used = 0;
+		shard.index = std::stoul(spec.substr(0, slash), &used);
+		if (used != slash) {
+			return std::nullopt;
+		}
+
+		const auto count = spec.substr(slash + 1);
+		shard.count = std::stoul(count, &used);
+		if (used != count.size()) {
+			return std::nullopt;
+		}
+	} catch (const std::exception& err) {
+		return std::nullopt;
+	}
+
+	if (shard.count == 0 || shard.index >= shard.count) {
+		return std::nullopt;
+	}
+
+	return shard;
+}
+
+TEST_CASE("parse_shard()") {
+	CHECK(parse_shard("0/1").has_value());
+	CHECK(parse_shard("2/3")->index == 2);
+	CHECK(parse_shard("2/3")->count == 3);
+	CHECK(!parse_shard("3/3").has_value());
+	CHECK(!parse_shard("1/0").has_value());
+	CHECK(!parse_shard("1").has_value());
+	CHECK(!parse_shard("a/2").has_value());
+	CHECK(!parse_shard("1/2x").has_value());
+}
+
+// relative_path must be relative to the input directory so every host agrees regardless of mount point
+bool in_shard(const Shard& shard, std::string_view relative_path) {
+	return stable_path_hash(relative_path) % shard.count == shard.index;
+}
+
+TEST_CASE("in_shard()") {
+	const std::vector<std::string> paths = {"a.pdf", "b/c.epub", "d/e/f.mobi", "g.doc", "h.pdf", "i.pdf"};
+
+	// every path lands in exactly one shard
+	for (const auto& path : paths) {
+		int owners = 0;
+		for (std::size_t i = 0; i < 3; i++) {
+			owners += in_shard({i, 3}, path) ? 1 : 0;
+		}
+		CHECK(owners == 1);
+	}
+
+	for (const auto& path : paths) {
+		CHECK(in_shard({0, 1}, path));
+	}
+}
+
+// Combines result arrays, keeping the first record seen for each filepath
+json merge_outputs(const std::vector<json>& outputs) {
+	json merged = json::array();
+	std::unordered_set<std::string> seen{};
+
+	for (const auto& output : outputs) {
+		if (!output.is_array()) {
+			continue;
+		}
+
+		for (const auto& book : output) {
+			if (!book.is_object() || !book.contains("filepath")) {
+				continue;
+			}
+
+			if (!book["filepath"].is_string()) {
+				console_log()->warn("merge_outputs(): skipping a record whose filepath is not a string: {}",
+									book["filepath"].dump());
+				continue;
+			}
+
+			if (seen.insert(book["filepath"].get<std::string>()).second) {
+				merged.push_back(book);
+			}
+		}
+	}
+
+	return merged;
+}
+
+TEST_CASE("merge_outputs()") {
+	const auto first = json::parse(R"([{"filepath": "a.pdf", "isbn": 1}, {"filepath": "b.pdf", "isbn": 2}])");
+	const auto second = json::parse(R"([{"filepath": "b.pdf", "isbn": 3}, {"filepath": "c.pdf", "isbn": 4}])");
+
+	const auto malformed = json::parse(R"([{"filepath": 5, "isbn": 5}, {"filepath": "d.pdf", "isbn": 6}])");
+
+	const auto merged = merge_outputs({first, second, json::object(), malformed});
+	CHECK(merged.size() == 4);
+	CHECK(merged[1]["isbn"] == 2);
+	CHECK(merged[2]["filepath"] == "c.pdf");
+	CHECK(merged[3]["filepath"] == "d.pdf");
+}
+
+json merge_output_files(const std::vector<std::string>& filepaths) {
+	std::vector<json> outputs{};
+
+	for (const auto& filepath : filepaths) {
+		try {
+			std::ifstream fh(filepath);
+			outputs.push_back(json::parse(fh));
+		} catch (const std::exception& err) {
+			console_log()->warn("merge_output_files(): could not read {}, skipping it", filepath);
+		}
+	}
+
+	return merge_outputs(outputs);
+}
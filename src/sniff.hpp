@@ -0,0 +1,247 @@
+/*
+Copyright 2023 larkwiot
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+		http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include <array>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+
+#include <nlohmann/json.hpp>
+
+#include "test.hpp"
+
+#pragma once
+
+enum class FileKind {
+	unknown,
+	pdf,
+	epub,
+	docx,
+	// a zip that is neither of the above as far as its first entries tell
+	zip,
+	mobi,
+	// OLE compound document with a WordDocument stream, i.e. a .doc
+	doc,
+	// any other OLE compound document (.xls, .ppt, .msg, .msi, Thumbs.db), or a .doc whose directory lies past the
+	// sniffed bytes
+	ole,
+};
+
+// how much of the start of a file sniff_file_kind() looks at
+static constexpr std::size_t sniff_length = 4096;
+
+struct Signature {
+	FileKind kind;
+	std::size_t offset;
+	std::string_view magic;
+};
+
+static constexpr std::array<Signature, 4> signatures = {{
+	{FileKind::zip, 0, "PK\x03\x04"},
+	{FileKind::ole, 0, "\xD0\xCF\x11\xE0\xA1\xB1\x1A\xE1"},
+	// PalmDB type and creator, MOBI/AZW/AZW3 and plain PalmDOC
+	{FileKind::mobi, 60, "BOOKMOBI"},
+	{FileKind::mobi, 60, "TEXtREAd"},
+}};
+
+// readers accept junk before the PDF header as long as it starts within this many bytes
+static constexpr std::size_t pdf_header_window = 1024;
+
+std::uint16_t little_endian_u16(std::string_view bytes, std::size_t offset) {
+	return static_cast<std::uint16_t>(static_cast<unsigned char>(bytes[offset]) |
+									  static_cast<unsigned char>(bytes[offset + 1]) << 8);
+}
+
+// EPUBs must start with a stored "mimetype" entry naming their type, DOCX have word/ entries among the first few small
+// ones
+FileKind zip_kind(std::string_view head) {
+	static constexpr std::size_t local_header_size = 30;
+	if (head.size() < local_header_size) {
+		return FileKind::zip;
+	}
+
+	const auto name_length = little_endian_u16(head, 26);
+	const auto extra_length = little_endian_u16(head, 28);
+	const auto name = head.substr(local_header_size).substr(0, name_length);
+	if (name == "mimetype") {
+		const auto data = head.substr(std::min(head.size(), local_header_size + name_length + extra_length));
+		if (data.starts_with("application/epub+zip")) {
+			return FileKind::epub;
+		}
+	}
+
+	if (head.find("[Content_Types].xml") != std::string_view::npos && head.find("word/") != std::string_view::npos) {
+		return FileKind::docx;
+	}
+
+	return FileKind::zip;
+}
+
+// Word documents have a "WordDocument" entry in their directory, names there are UTF-16LE
+FileKind ole_kind(std::string_view head) {
+	static constexpr std::string_view word_document{"W\0o\0r\0d\0D\0o\0c\0u\0m\0e\0n\0t\0\0\0", 26};
+	return head.find(word_document) != std::string_view::npos ? FileKind::doc : FileKind::ole;
+}
+
+// What the first sniff_length bytes of a file say it is
+FileKind sniff_file_kind(std::string_view head) {
+	if (head.substr(0, pdf_header_window).find("%PDF-") != std::string_view::npos) {
+		return FileKind::pdf;
+	}
+
+	for (const auto& signature : signatures) {
+		if (head.size() >= signature.offset + signature.magic.size() &&
+			head.substr(signature.offset, signature.magic.size()) == signature.magic) {
+			switch (signature.kind) {
+				case FileKind::zip:
+					return zip_kind(head);
+				case FileKind::ole:
+					return ole_kind(head);
+				default:
+					return signature.kind;
+			}
+		}
+	}
+
+	return FileKind::unknown;
+}
+
+std::string_view sniffed_mime_type(FileKind kind) {
+	switch (kind) {
+		case FileKind::pdf:
+			return "application/pdf";
+		case FileKind::epub:
+			return "application/epub+zip";
+		case FileKind::docx:
+			return "application/vnd.openxmlformats-officedocument.wordprocessingml.document";
+		case FileKind::mobi:
+			return "application/x-mobipocket-ebook";
+		case FileKind::doc:
+			return "application/msword";
+		default:
+			return "";
+	}
+}
+
+// whether filetypes maps any extension to mime_type
+bool is_listed_mime_type(std::string_view mime_type, const nlohmann::json& filetypes) {
+	for (const auto& [extension, listed] : filetypes.items()) {
+		if (listed.is_string() && listed.get<std::string>() == mime_type) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// The MIME type to send a file to Tika as, or nothing if it should not be sent at all. filetypes is the list of what
+// may be sent at all. Among those, a recognized signature decides, a zip or OLE file that could not be told apart goes
+// by its extension (an OLE file only counts as a .doc if it is named like one or not at all), and a file without a
+// signature is only sent if its extension maps to a type that has none (so a misnamed .pdf is dropped, a .txt added to
+// filetypes.json is not).
+std::optional<std::string> choose_mime_type(FileKind kind, const std::string& extension, const nlohmann::json& filetypes) {
+	auto sniffed = std::string{sniffed_mime_type(kind)};
+	if (sniffed.empty() && kind == FileKind::ole && (extension.empty() || extension == "doc")) {
+		sniffed = sniffed_mime_type(FileKind::doc);
+	}
+	if (!sniffed.empty()) {
+		return is_listed_mime_type(sniffed, filetypes) ? std::optional{sniffed} : std::nullopt;
+	}
+
+	if (extension.empty() || !filetypes.contains(extension)) {
+		return std::nullopt;
+	}
+	const auto by_extension = filetypes[extension].get<std::string>();
+
+	if (kind == FileKind::zip || kind == FileKind::ole) {
+		return by_extension;
+	}
+
+	for (const auto candidate : {FileKind::pdf, FileKind::epub, FileKind::docx, FileKind::mobi, FileKind::doc}) {
+		if (sniffed_mime_type(candidate) == by_extension) {
+			return std::nullopt;
+		}
+	}
+	return by_extension;
+}
+
+TEST_CASE("sniff_file_kind()") {
+	using namespace std::string_literals;
+
+	CHECK(sniff_file_kind("%PDF-1.7\n%\xE2\xE3\xCF\xD3") == FileKind::pdf);
+	CHECK(sniff_file_kind("\r\n\r\n%PDF-1.4") == FileKind::pdf);
+	CHECK(sniff_file_kind("<html><body>404</body></html>") == FileKind::unknown);
+	CHECK(sniff_file_kind("") == FileKind::unknown);
+
+	// local file header: signature, version, flags, method 0 (stored), times, crc, sizes, name length 8, extra 0
+	const auto epub = "PK\x03\x04"s + "\x0A\x00\x00\x00\x00\x00"s + std::string(16, '\x00') + "\x08\x00\x00\x00"s +
+					  "mimetypeapplication/epub+zipPK\x03\x04"s;
+	CHECK(sniff_file_kind(epub) == FileKind::epub);
+
+	const auto docx = "PK\x03\x04"s + std::string(22, '\x00') + "\x13\x00\x00\x00"s + "[Content_Types].xml" +
+					  std::string(100, '\x01') + "PK\x03\x04" + "word/document.xml";
+	CHECK(sniff_file_kind(docx) == FileKind::docx);
+	CHECK(sniff_file_kind("PK\x03\x04"s + std::string(40, '\x00')) == FileKind::zip);
+
+	const auto ole = "\xD0\xCF\x11\xE0\xA1\xB1\x1A\xE1"s + std::string(504, '\x00');
+	CHECK(sniff_file_kind(ole) == FileKind::ole);
+	// a directory entry in the second sector: Thumbs.db has a Catalog stream, a .doc a WordDocument one
+	const auto entry = [](std::string_view name) {
+		std::string utf16{};
+		for (const auto c : name) {
+			utf16 += c;
+			utf16 += '\x00';
+		}
+		return utf16 + "\x00\x00"s + std::string(128 - 2 - utf16.size(), '\x00');
+	};
+	CHECK(sniff_file_kind(ole + entry("Root Entry") + entry("Catalog")) == FileKind::ole);
+	CHECK(sniff_file_kind(ole + entry("Root Entry") + entry("WordDocument")) == FileKind::doc);
+	CHECK(sniff_file_kind(std::string(60, '\x00') + "BOOKMOBI" + std::string(20, '\x00')) == FileKind::mobi);
+	CHECK(sniff_file_kind(std::string(60, '\x00') + "BOOKMOB") == FileKind::unknown);
+}
+
+TEST_CASE("choose_mime_type()") {
+	const auto filetypes = nlohmann::json::parse(R"({"pdf": "application/pdf", "txt": "text/plain",
+		"epub": "application/epub+zip", "azw": "application/x-mobipocket-ebook",
+		"cbz": "application/vnd.comicbook+zip"})");
+
+	// the signature wins over the extension, and makes extensions unnecessary
+	CHECK(choose_mime_type(FileKind::pdf, "epub", filetypes) == "application/pdf");
+	CHECK(choose_mime_type(FileKind::mobi, "", filetypes) == "application/x-mobipocket-ebook");
+	CHECK(choose_mime_type(FileKind::mobi, "prc", filetypes) == "application/x-mobipocket-ebook");
+
+	// but only for types filetypes.json lists, taking one out of it stops those files being sent
+	CHECK(!choose_mime_type(FileKind::docx, "docx", filetypes).has_value());
+	CHECK(!choose_mime_type(FileKind::doc, "", filetypes).has_value());
+
+	CHECK(choose_mime_type(FileKind::zip, "cbz", filetypes) == "application/vnd.comicbook+zip");
+	CHECK(!choose_mime_type(FileKind::zip, "jar", filetypes).has_value());
+
+	// an unrecognizable .pdf is not a PDF, but plain text has no signature to check
+	CHECK(!choose_mime_type(FileKind::unknown, "pdf", filetypes).has_value());
+	CHECK(choose_mime_type(FileKind::unknown, "txt", filetypes) == "text/plain");
+	CHECK(!choose_mime_type(FileKind::unknown, "jpg", filetypes).has_value());
+
+	// spreadsheets, thumbnail caches and installers are OLE files too, only a .doc or an unnamed one is taken for Word
+	const auto with_doc = nlohmann::json::parse(R"({"doc": "application/msword", "xls": "application/vnd.ms-excel"})");
+	CHECK(choose_mime_type(FileKind::doc, "xls", with_doc) == "application/msword");
+	CHECK(choose_mime_type(FileKind::ole, "doc", with_doc) == "application/msword");
+	CHECK(choose_mime_type(FileKind::ole, "", with_doc) == "application/msword");
+	CHECK(choose_mime_type(FileKind::ole, "xls", with_doc) == "application/vnd.ms-excel");
+	CHECK(!choose_mime_type(FileKind::ole, "db", with_doc).has_value());
+	CHECK(!choose_mime_type(FileKind::ole, "msi", with_doc).has_value());
+	CHECK(!choose_mime_type(FileKind::unknown, "doc", with_doc).has_value());
+}
@@ -6,10 +6,11 @@
 
 #include <doctest/doctest.h>
 
+#include "log.hpp"
+
 int main(int argc, char** argv) {
-	auto console_log = spdlog::stdout_color_mt("console");
-	auto error_log = spdlog::stdout_color_mt("stderr");
-	spdlog::flush_every(std::chrono::seconds(5));
+	// synchronous so test output is not interleaved with queued log messages
+	init_logging(false);
 	spdlog::set_level(spdlog::level::debug);
 
 	doctest::Context context;
@@ -0,0 +1,321 @@
+/*
+Copyright 2023 larkwiot
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+		http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <unistd.h>
+
+#include <spdlog/spdlog.h>
+#include <zstd.h>
+
+#include "log.hpp"
+#include "test.hpp"
+
+#pragma once
+
+// murmur3's finalizer, a cheap way to make every input bit affect every output bit
+constexpr std::uint64_t mix64(std::uint64_t x) {
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdull;
+	x ^= x >> 33;
+	x *= 0xc4ceb9fe1a85ec53ull;
+	x ^= x >> 33;
+	return x;
+}
+
+// Fast, stable 64-bit hash of file contents, a word at a time
+std::uint64_t content_hash(std::string_view content) {
+	std::uint64_t hash = mix64(0x9e3779b97f4a7c15ull ^ content.size());
+
+	std::size_t i = 0;
+	for (; i + 8 <= content.size(); i += 8) {
+		std::uint64_t word = 0;
+		std::memcpy(&word, content.data() + i, 8);
+		hash = mix64(hash ^ word) + 0x9e3779b97f4a7c15ull;
+	}
+
+	std::uint64_t tail = 0;
+	std::memcpy(&tail, content.data() + i, content.size() - i);
+	return mix64(hash ^ tail);
+}
+
+TEST_CASE("content_hash()") {
+	CHECK(content_hash("") == content_hash(""));
+	CHECK(content_hash("abcdefgh") != content_hash("abcdefgi"));
+	CHECK(content_hash("abcdefghijk") != content_hash("abcdefghijj"));
+	// trailing zero bytes change the length and so the hash
+	CHECK(content_hash(std::string_view{"a\0", 2}) != content_hash("a"));
+}
+
+// On-disk cache of extracted text keyed by a hash of the input file's contents and of the extractor that produced it,
+// so downstream changes (matching, metadata providers, max_characters_to_search) never need Tika again. Texts are
+// capped at a prefix, stored zstd compressed, and the least recently used ones are evicted past a size limit. Use
+// times are kept in the files' mtimes so the LRU order survives between runs.
+class TextCache {
+	struct Entry {
+		std::uintmax_t size{};
+		std::filesystem::file_time_type last_use{};
+	};
+
+	std::filesystem::path _directory;
+	std::uintmax_t _max_bytes;
+	std::size_t _max_characters;
+	int _level;
+	std::uint64_t _extractor;
+
+	std::mutex _mutex{};
+	std::unordered_map<std::string, Entry> _entries{};
+	std::uintmax_t _total{};
+
+	std::filesystem::path path_for(const std::string& key) const {
+		return _directory / key.substr(0, 2) / (key + ".zst");
+	}
+
+	// drops least recently used entries until there is room for incoming bytes, with some slack so this does not run
+	// on every insert
+	void evict(std::uintmax_t incoming) {
+		if (_total + incoming <= _max_bytes) {
+			return;
+		}
+
+		std::vector<std::pair<std::filesystem::file_time_type, std::string>> by_age{};
+		by_age.reserve(_entries.size());
+		for (const auto& [key, entry] : _entries) {
+			by_age.emplace_back(entry.last_use, key);
+		}
+		std::sort(by_age.begin(), by_age.end());
+
+		const auto target = _max_bytes - std::min(_max_bytes, _max_bytes / 10 + incoming);
+		for (const auto& [last_use, key] : by_age) {
+			if (_total <= target) {
+				break;
+			}
+
+			std::error_code error{};
+			std::filesystem::remove(path_for(key), error);
+			_total -= _entries[key].size;
+			_entries.erase(key);
+		}
+	}
+
+   public:
+	explicit TextCache(std::filesystem::path directory,
+					   std::uintmax_t max_bytes,
+					   std::size_t max_characters,
+					   const std::string& extractor_version,
+					   int level = 3)
+		: _directory(std::move(directory)),
+		  _max_bytes(max_bytes),
+		  _max_characters(max_characters),
+		  _level(level),
+		  // the prefix length is part of the key too, a longer cap must not be served a shorter cached text
+		  _extractor(mix64(content_hash(extractor_version) ^ max_characters)) {
+		std::error_code error{};
+		std::filesystem::create_directories(_directory, error);
+
+		for (const auto& file : std::filesystem::recursive_directory_iterator(_directory, error)) {
+			if (!file.is_regular_file(error) || file.path().extension() != ".zst") {
+				continue;
+			}
+
+			const auto size = file.file_size(error);
+			_entries[file.path().stem().string()] = Entry{size, file.last_write_time(error)};
+			_total += size;
+		}
+	}
+
+	std::size_t size() {
+		std::lock_guard lock{_mutex};
+		return _entries.size();
+	}
+
+	std::uintmax_t bytes() {
+		std::lock_guard lock{_mutex};
+		return _total;
+	}
+
+	std::string key(std::string_view content) const {
+		return fmt::format("{:016x}{:016x}{:012x}", content_hash(content), _extractor, content.size());
+	}
+
+	std::optional<std::string> get(const std::string& key) {
+		{
+			std::lock_guard lock{_mutex};
+			if (!_entries.contains(key)) {
+				return std::nullopt;
+			}
+		}
+
+		const auto path = path_for(key);
+		std::string compressed;
+		{
+			std::ifstream fh(path, std::ios::binary);
+			compressed.assign(std::istreambuf_iterator<char>(fh), std::istreambuf_iterator<char>());
+		}
+
+		const auto length = ZSTD_getFrameContentSize(compressed.data(), compressed.size());
+		if (compressed.empty() || length == ZSTD_CONTENTSIZE_ERROR || length == ZSTD_CONTENTSIZE_UNKNOWN) {
+			console_log()->warn("TextCache: dropping unreadable entry {}", path.string());
+			std::lock_guard lock{_mutex};
+			if (_entries.contains(key)) {
+				_total -= _entries[key].size;
+				_entries.erase(key);
+			}
+			return std::nullopt;
+		}
+
+		std::string text(length, '\0');
+		const auto decompressed = ZSTD_decompress(text.data(), text.size(), compressed.data(), compressed.size());
+		if (ZSTD_isError(decompressed)) {
+			console_log()->warn("TextCache: could not decompress {}: {}", path.string(),
+								ZSTD_getErrorName(decompressed));
+			return std::nullopt;
+		}
+		text.resize(decompressed);
+
+		const auto now = std::filesystem::file_time_type::clock::now();
+		std::error_code error{};
+		std::filesystem::last_write_time(path, now, error);
+		{
+			std::lock_guard lock{_mutex};
+			if (_entries.contains(key)) {
+				_entries[key].last_use = now;
+			}
+		}
+
+		return text;
+	}
+
+	void put(const std::string& key, std::string_view text) {
+		text = text.substr(0, _max_characters);
+
+		std::string compressed(ZSTD_compressBound(text.size()), '\0');
+		const auto length = ZSTD_compress(compressed.data(), compressed.size(), text.data(), text.size(), _level);
+		if (ZSTD_isError(length)) {
+			console_log()->warn("TextCache: could not compress text: {}", ZSTD_getErrorName(length));
+			return;
+		}
+		compressed.resize(length);
+
+		const auto path = path_for(key);
+		std::error_code error{};
+		std::filesystem::create_directories(path.parent_path(), error);
+
+		// written aside and renamed so readers (or other scanner processes) never see half a file
+		const auto temporary = path.string() + fmt::format(".{}.tmp", gettid());
+		{
+			std::ofstream fh(temporary, std::ios::binary | std::ios::trunc);
+			fh.write(compressed.data(), static_cast<long>(compressed.size()));
+			if (!fh) {
+				console_log()->warn("TextCache: could not write {}", temporary);
+				std::filesystem::remove(temporary, error);
+				return;
+			}
+		}
+		std::filesystem::rename(temporary, path, error);
+		if (error) {
+			std::filesystem::remove(temporary, error);
+			return;
+		}
+
+		std::lock_guard lock{_mutex};
+		// the file was just replaced, so the old entry goes before evict() can pick it and remove the new file
+		if (_entries.contains(key)) {
+			_total -= _entries[key].size;
+			_entries.erase(key);
+		}
+		evict(compressed.size());
+		_entries[key] = Entry{compressed.size(), std::filesystem::file_time_type::clock::now()};
+		_total += compressed.size();
+	}
+};
+
+TEST_CASE("TextCache") {
+	const auto root = std::filesystem::temp_directory_path() / fmt::format("isbn_scanner_cache_{}", getpid());
+	std::filesystem::remove_all(root);
+
+	const std::string text = "ISBN 978-0-7356-8293-1 " + std::string(5000, 'a');
+
+	{
+		TextCache cache{root, 1 << 20, 1000, "Apache Tika 2.7.0"};
+		const auto key = cache.key("file contents");
+		CHECK(!cache.get(key).has_value());
+
+		cache.put(key, text);
+		auto cached = cache.get(key);
+		REQUIRE(cached.has_value());
+		CHECK(cached->size() == 1000);
+		CHECK(cached.value() == text.substr(0, 1000));
+
+		// a different extractor or prefix length never shares entries
+		CHECK(TextCache{root, 1 << 20, 1000, "Apache Tika 2.8.0"}.key("file contents") != key);
+		CHECK(TextCache{root, 1 << 20, 2000, "Apache Tika 2.7.0"}.key("file contents") != key);
+	}
+
+	{
+		// entries written by an earlier run are found again
+		TextCache cache{root, 1 << 20, 1000, "Apache Tika 2.7.0"};
+		CHECK(cache.size() == 1);
+		CHECK(cache.get(cache.key("file contents")).has_value());
+	}
+
+	{
+		TextCache cache{root, 200, 1000, "other"};
+		std::vector<std::string> keys{};
+		for (int i = 0; i < 20; i++) {
+			// incompressible enough that a handful fill the limit
+			std::string random_text{};
+			for (int j = 0; j < 100; j++) {
+				random_text += static_cast<char>(mix64(static_cast<std::uint64_t>(i * 100 + j)) & 0xff);
+			}
+			keys.push_back(cache.key(random_text));
+			cache.put(keys.back(), random_text);
+		}
+		CHECK(cache.bytes() <= 200);
+		CHECK(cache.get(keys.back()).has_value());
+		CHECK(!cache.get(keys.front()).has_value());
+	}
+
+	{
+		// putting a key again replaces its file, which eviction must not then remove as the oldest entry
+		TextCache cache{root / "small", 200, 1000, "other"};
+		std::string short_text{};
+		std::string long_text{};
+		for (int j = 0; j < 100; j++) {
+			(j < 50 ? short_text : long_text) += static_cast<char>(mix64(static_cast<std::uint64_t>(j)) & 0xff);
+			long_text += static_cast<char>(mix64(static_cast<std::uint64_t>(j + 100)) & 0xff);
+		}
+		cache.put("again", short_text);
+		cache.put("other", long_text.substr(0, 100));
+		cache.put("again", long_text);
+
+		CHECK(cache.get("again").value() == long_text);
+		CHECK(cache.size() == 1);
+		CHECK(cache.bytes() == std::filesystem::file_size(root / "small" / "ag" / "again.zst"));
+	}
+
+	std::filesystem::remove_all(root);
+}
@@ -24,71 +24,17 @@ limitations under the License.
 #include <spdlog/spdlog.h>
 #include <ctre.hpp>
 
+#include "log.hpp"
 #include "test.hpp"
 
 #pragma once
 
 using ISBN = unsigned long;
 
-std::vector<char> read_file_bytes(const std::string& fn) {
-	std::ifstream fh{fn, std::ios::binary | std::ios::ate};
-
-	if (!fh) {
-		//		spdlog::get("stderr")->error("could not open file: {}", fn);
-		exit(0);
-	}
-
-	auto end = fh.tellg();
-	fh.seekg(0, std::ios::beg);
-
-	auto size = std::size_t(end - fh.tellg());
-
-	if (size == 0) {
-		return {};
-	}
-
-	std::vector<char> bytes(size);
-
-	if (!fh.read(reinterpret_cast<char*>(bytes.data()), static_cast<long>(bytes.size()))) {
-		//		spdlog::get("stderr")->error("could not read file: {}", fn);
-		exit(0);
-	}
-
-	//	spdlog::get("console")->debug("process_file(): read file {} at {} bytes", fn, fn.size());
-
-	return bytes;
-}
-
-std::string read_file_bytes_as_string(const std::string& fn) {
-	std::ifstream fh{fn, std::ios::binary | std::ios::ate};
-
-	if (!fh) {
-		exit(0);
-	}
-
-	auto end = fh.tellg();
-	fh.seekg(0, std::ios::beg);
-
-	auto size = std::size_t(end - fh.tellg());
-
-	if (size == 0) {
-		return {};
-	}
-
-	std::string bytes;
-	bytes.resize(size);
-
-	if (!fh.read(reinterpret_cast<char*>(bytes.data()), static_cast<long>(bytes.size()))) {
-		exit(0);
-	}
-
-	return bytes;
-}
-
 constexpr int ctoi(char c) {
 	int res = c - '0';
 	if (res < 0 || res > 9) {
-		//		spdlog::get("stderr")->error("ctoi(): resulting number out of range! got {} -> {}", c, res);
+		//		error_log()->error("ctoi(): resulting number out of range! got {} -> {}", c, res);
 		return res;
 	}
 	return res;
@@ -124,7 +70,7 @@ const std::unordered_set<char> isbn_chars = {'0', '1', '2', '3', '4', '5', '6',
 static constexpr auto all_one_char = ctll::fixed_string{"(.)\\1+"};
 
 tao::tuple<bool, ISBN> is_valid_isbn(std::string isbn) {
-//	spdlog::get("console")->debug("is_valid_isbn(): raw ISBN: {}", isbn);
+//	LOG_DEBUG("is_valid_isbn(): raw ISBN: {}", isbn);
 
 	std::erase_if(isbn, [](char c) { return !isbn_chars.contains(c); });
 
@@ -137,7 +83,7 @@ tao::tuple<bool, ISBN> is_valid_isbn(std::string isbn) {
 	}
 
 	if (isbn.length() == 10) {
-		spdlog::get("console")->debug("is_valid_isbn(): cleaned ISBN: {}", isbn);
+		LOG_DEBUG("is_valid_isbn(): cleaned ISBN: {}", isbn);
 
 		int multiplier = 10;
 		int sum = 0;
@@ -145,7 +91,7 @@ tao::tuple<bool, ISBN> is_valid_isbn(std::string isbn) {
 		auto isbn_end = isbn.end();
 		for (auto di = isbn.begin(); di != isbn_end; ++di) {
 			if (multiplier < 1) {
-				spdlog::get("stderr")->error("is_valid_isbn(): tried to use ISBN 10 multiplier < 2! ISBN: {}", isbn);
+				error_log()->error("is_valid_isbn(): tried to use ISBN 10 multiplier < 2! ISBN: {}", isbn);
 			}
 
 			auto d = *di;
@@ -154,7 +100,7 @@ tao::tuple<bool, ISBN> is_valid_isbn(std::string isbn) {
 				if (di == isbn_end - 1) {
 					sum += multiplier * 10;
 				} else {
-					spdlog::get("console")->debug("is_valid_isbn(): ISBN {} had X not at end", isbn);
+					LOG_DEBUG("is_valid_isbn(): ISBN {} had X not at end", isbn);
 					return tao::make_tuple(false, 0ul);
 				}
 			} else {
@@ -169,19 +115,19 @@ tao::tuple<bool, ISBN> is_valid_isbn(std::string isbn) {
 			return tao::make_tuple(true, std::stoul(isbn));
 		}
 
-		spdlog::get("console")->debug("is_valid_isbn(): ISBN {} invalid ISBN 10 checksum", isbn);
+		LOG_DEBUG("is_valid_isbn(): ISBN {} invalid ISBN 10 checksum", isbn);
 
 		return tao::make_tuple(false, 0ul);
 
 	} else if (isbn.length() == 13) {
-		spdlog::get("console")->debug("is_valid_isbn(): cleaned ISBN: {}", isbn);
+		LOG_DEBUG("is_valid_isbn(): cleaned ISBN: {}", isbn);
 
 		auto first_12 = isbn.substr(0, 12);
 		unsigned long check_digit = 0;
 		try {
 			check_digit = std::stoul(isbn.substr(12));
 		} catch (const std::invalid_argument& err) {
-			spdlog::get("console")->debug("ISBN {} cannot be converted to number", isbn.substr(12));
+			LOG_DEBUG("ISBN {} cannot be converted to number", isbn.substr(12));
 			return tao::make_tuple(false, 0ul);
 		}
 		int multiplier = 1;
@@ -203,12 +149,12 @@ tao::tuple<bool, ISBN> is_valid_isbn(std::string isbn) {
 			return tao::make_tuple(true, std::stoul(isbn));
 		}
 
-		spdlog::get("console")->debug("is_valid_isbn(): ISBN {} invalid ISBN 13 checksum", isbn);
+		LOG_DEBUG("is_valid_isbn(): ISBN {} invalid ISBN 13 checksum", isbn);
 
 		return tao::make_tuple(false, 0ul);
 	}
 
-//	spdlog::get("console")->debug("is_valid_isbn(): ISBN {} is not a valid length", isbn);
+//	LOG_DEBUG("is_valid_isbn(): ISBN {} is not a valid length", isbn);
 
 	return tao::make_tuple(false, 0ul);
 }
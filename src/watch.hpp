@@ -0,0 +1,239 @@
+/*
+Copyright 2023 larkwiot
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+		http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+
+#include <spdlog/spdlog.h>
+
+#include "log.hpp"
+#include "test.hpp"
+
+#pragma once
+
+struct WatchedFile {
+	std::string filepath;
+	// when the first event for this version of the file arrived
+	std::chrono::steady_clock::time_point landed;
+};
+
+// Recursively watches a directory with inotify and reports files once they have stopped changing, so files that are
+// still being copied in are not picked up half written
+class DirectoryWatcher {
+	static constexpr uint32_t directory_events = IN_CREATE | IN_MOVED_TO | IN_CLOSE_WRITE | IN_MODIFY | IN_DELETE |
+												 IN_MOVED_FROM;
+
+	struct Pending {
+		std::chrono::steady_clock::time_point landed;
+		std::chrono::steady_clock::time_point last_event;
+		std::uintmax_t size{};
+	};
+
+	int _fd{-1};
+	std::chrono::milliseconds _debounce;
+	std::unordered_map<int, std::filesystem::path> _directories{};
+	std::map<std::string, Pending> _pending{};
+
+	void touch(const std::string& filepath, std::chrono::steady_clock::time_point now) {
+		auto [found, inserted] = _pending.try_emplace(filepath, Pending{now, now, 0});
+		found->second.last_event = now;
+	}
+
+	// new directories may already have files in them by the time the watch is added, so those are queued as well
+	void add_directory(const std::filesystem::path& directory, std::chrono::steady_clock::time_point now) {
+		std::error_code error{};
+		auto iterator = std::filesystem::recursive_directory_iterator(directory, error);
+		add_watch(directory);
+
+		for (const auto& entry : iterator) {
+			if (entry.is_directory(error)) {
+				add_watch(entry.path());
+			} else if (entry.is_regular_file(error)) {
+				touch(entry.path().string(), now);
+			}
+		}
+	}
+
+	void add_watch(const std::filesystem::path& directory) {
+		const int wd = inotify_add_watch(_fd, directory.c_str(), directory_events | IN_ONLYDIR);
+		if (wd < 0) {
+			console_log()->warn("DirectoryWatcher: could not watch {}: {}", directory.string(), std::strerror(errno));
+			return;
+		}
+		_directories[wd] = directory;
+	}
+
+	void handle(const inotify_event& event, std::chrono::steady_clock::time_point now) {
+		if (event.mask & IN_Q_OVERFLOW) {
+			console_log()->warn("DirectoryWatcher: event queue overflowed, rescanning watched directories");
+			for (const auto& [wd, directory] : std::unordered_map{_directories}) {
+				add_directory(directory, now);
+			}
+			return;
+		}
+
+		if (event.mask & IN_IGNORED) {
+			_directories.erase(event.wd);
+			return;
+		}
+
+		const auto directory = _directories.find(event.wd);
+		if (directory == _directories.end() || event.len == 0) {
+			return;
+		}
+
+		const auto path = directory->second / event.name;
+
+		if (event.mask & IN_ISDIR) {
+			if (event.mask & (IN_CREATE | IN_MOVED_TO)) {
+				add_directory(path, now);
+			}
+			return;
+		}
+
+		if (event.mask & (IN_DELETE | IN_MOVED_FROM)) {
+			_pending.erase(path.string());
+			return;
+		}
+
+		touch(path.string(), now);
+	}
+
+   public:
+	explicit DirectoryWatcher(const std::string& root, std::chrono::milliseconds debounce) : _debounce(debounce) {
+		_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (_fd < 0) {
+			error_log()->error("DirectoryWatcher: could not initialize inotify: {}", std::strerror(errno));
+			return;
+		}
+
+		add_watch(root);
+		std::error_code error{};
+		for (const auto& entry : std::filesystem::recursive_directory_iterator(root, error)) {
+			if (entry.is_directory(error)) {
+				add_watch(entry.path());
+			}
+		}
+	}
+
+	DirectoryWatcher(const DirectoryWatcher&) = delete;
+	DirectoryWatcher& operator=(const DirectoryWatcher&) = delete;
+
+	~DirectoryWatcher() {
+		if (_fd >= 0) {
+			close(_fd);
+		}
+	}
+
+	bool watching() const {
+		return _fd >= 0 && !_directories.empty();
+	}
+
+	// Waits up to timeout for events, then returns every file that has been quiet for the debounce interval and whose
+	// size did not change since it was last looked at
+	std::vector<WatchedFile> poll(std::chrono::milliseconds timeout) {
+		pollfd descriptor{_fd, POLLIN, 0};
+		const int ready = ::poll(&descriptor, 1, static_cast<int>(timeout.count()));
+
+		auto now = std::chrono::steady_clock::now();
+
+		if (ready > 0) {
+			alignas(inotify_event) char buffer[64 * 1024];
+			for (;;) {
+				const auto length = read(_fd, buffer, sizeof(buffer));
+				if (length <= 0) {
+					break;
+				}
+
+				for (char* cursor = buffer; cursor < buffer + length;) {
+					const auto* event = reinterpret_cast<const inotify_event*>(cursor);
+					handle(*event, now);
+					cursor += sizeof(inotify_event) + event->len;
+				}
+			}
+		}
+
+		std::vector<WatchedFile> settled{};
+
+		for (auto it = _pending.begin(); it != _pending.end();) {
+			auto& [filepath, pending] = *it;
+
+			if (now - pending.last_event < _debounce) {
+				++it;
+				continue;
+			}
+
+			std::error_code error{};
+			const auto size = std::filesystem::file_size(filepath, error);
+			if (error) {
+				it = _pending.erase(it);
+				continue;
+			}
+
+			// still growing without producing events we saw (e.g. written over NFS), give it another interval
+			if (size != pending.size) {
+				pending.size = size;
+				pending.last_event = now;
+				++it;
+				continue;
+			}
+
+			settled.push_back({filepath, pending.landed});
+			it = _pending.erase(it);
+		}
+
+		return settled;
+	}
+};
+
+TEST_CASE("DirectoryWatcher") {
+	const auto root = std::filesystem::temp_directory_path() / fmt::format("isbn_scanner_watch_{}", getpid());
+	std::filesystem::remove_all(root);
+	std::filesystem::create_directories(root);
+
+	DirectoryWatcher watcher{root.string(), std::chrono::milliseconds(50)};
+	REQUIRE(watcher.watching());
+
+	std::filesystem::create_directories(root / "nested");
+	{
+		std::ofstream fh(root / "nested" / "book.epub");
+		fh << "not really an epub";
+	}
+
+	std::vector<WatchedFile> settled{};
+	for (int attempt = 0; attempt < 40 && settled.empty(); attempt++) {
+		settled = watcher.poll(std::chrono::milliseconds(50));
+	}
+
+	REQUIRE(settled.size() == 1);
+	CHECK(settled[0].filepath == (root / "nested" / "book.epub").string());
+
+	// nothing new happened, so nothing is reported again
+	CHECK(watcher.poll(std::chrono::milliseconds(100)).empty());
+
+	std::filesystem::remove_all(root);
+}